@@ -2,6 +2,7 @@
 // I N C L U D E S ////////////////////////////////////////////////////////////
 
 #include <iostream>
+#include <sstream>
 
 #include "safemap.h"
 
@@ -801,7 +802,647 @@ int main(int, char**)
   iteration_test<false, safe::EvenErased, true>();
   iteration_test<true, safe::EvenErased, true>();
 
-  // 5. Now, the big part: the threaded stress tests. 
+  // 5. Frozen map tests.
+  {
+    safe::map<int, MyValue> map4;
+    for (int i = 1; i <= 9; ++i)
+      map4.emplace(i * 10, MyValue(i));
+    auto pinned = map4.find(50);
+    map4.erase(50);
+    map4.erase(70);
+    safe::frozen_map<int, MyValue> frozen(map4);
+    map4.emplace(55, MyValue(55));
+
+    std::cout << "##########    The next non-debug line should read: >>> 10 20 30 40 60 80 90 | 60 60 * 2 * | 90 10" << std::endl;
+    std::string s = ">>> ";
+    for (auto i = frozen.begin(); i != frozen.end(); ++i)
+      s += std::to_string(i->first) + " ";
+    s += "| ";
+    s += std::to_string(frozen.lower_bound(50)->first) + " ";
+    s += std::to_string(frozen.upper_bound(55)->first) + " ";
+    s += (frozen.find(50) == frozen.end() ? std::string("* ") : std::to_string(frozen.find(50)->first) + " ");
+    s += std::to_string(int(frozen.at(20))) + " ";
+    s += (frozen.lower_bound(100) == frozen.end() ? std::string("* ") : std::string("? "));
+    s += "| " + std::to_string(frozen.rbegin()->first) + " " + std::to_string(frozen.crend().base()->first);
+    std::cout << s << std::endl;
+
+    auto snapshot = map4.snapshot();
+    map4.erase(55);
+    std::cout << "##########    The next non-debug line should read: >>> 8 0 1" << std::endl;
+    std::cout << ">>> " << snapshot.size() << " " << map4.count(55) << " " << snapshot.count(55) << std::endl;
+
+    safe::map<int, int> window;	// Slid along while snapshots are taken; each one must be a whole window
+    const int width = 20000;
+    for (int i = 0; i < width; ++i)
+      window.emplace(i, i);
+    std::atomic<bool> sliding(true);
+    std::thread slider([&window, &sliding, width]() {
+      for (int i = 0; sliding; ++i)
+      {
+        window.emplace(width + i, width + i);
+        window.erase(i);
+      }
+    });
+    bool whole = true;
+    for (int taken = 0; taken < 20; ++taken)
+    {
+      auto cut = window.snapshot();
+      int expected = cut.begin()->first;
+      whole = whole && ((cut.size() == size_t(width)) || (cut.size() == size_t(width + 1)));
+      for (auto i = cut.begin(); i != cut.end(); ++i, ++expected)
+        whole = whole && (i->first == expected) && (i->second == expected);
+    }
+    sliding = false;
+    slider.join();
+    std::cout << "##########    The next non-debug line should read: >>> 1" << std::endl;
+    std::cout << ">>> " << whole << std::endl;
+  }
+
+  // 6. Left-right map tests.
+  {
+    safe::left_right_map<int, MyValue> lr{{1, MyValue(1)}, {2, MyValue(2)}, {3, MyValue(3)}};
+    lr.emplace(4, MyValue(4));
+    lr.erase(2);
+    lr.assign(3, MyValue(30));
+    std::cout << "##########    The next non-debug line should read: >>> 1 3 4 | 30 3 4 | 3 0" << std::endl;
+    std::string s = ">>> ";
+    for (auto i = lr.cbegin(); i != lr.cend(); ++i)
+      s += std::to_string(i->first) + " ";
+    s += "| " + std::to_string(int(lr.at(3))) + " " + std::to_string(lr.lower_bound(2)->first) + " " + std::to_string(lr.upper_bound(3)->first);
+    s += " | " + std::to_string(lr.size()) + " " + std::to_string(lr.count(2));
+    std::cout << s << std::endl;
+
+    std::atomic<bool> done(false);
+    std::atomic<int> misses(0);
+    auto reader = std::thread([&]() {
+      while (!done)
+        if (lr.find(1) == lr.end())
+          ++misses;
+    });
+    for (int i = 10; i < 1000; ++i)
+    {
+      lr.emplace(i, MyValue(i));
+      lr.erase(i - 5);
+    }
+    done = true;
+    reader.join();
+    std::cout << "##########    The next non-debug line should read: >>> 0 8" << std::endl;
+    std::cout << ">>> " << misses << " " << lr.size() << std::endl;
+  }
+
+  // 7. Seqlocked value tests.
+  {
+    struct pair_of_ints { int a, b; };
+    safe::map<int, safe::seqlocked<pair_of_ints>> map5;
+    map5.emplace(1, pair_of_ints{0, 0});
+
+    std::atomic<bool> done(false);
+    std::atomic<int> torn(0);
+    auto reader = std::thread([&]() {
+      auto iter = map5.find(1);
+      while (!done)
+      {
+        const pair_of_ints p = iter->second;
+        if (p.a != p.b)
+          ++torn;
+      }
+    });
+    for (int i = 1; i <= 100000; ++i)
+    {
+      if (i % 2)
+        map5.find(1)->second = pair_of_ints{i, i};
+      else
+        map5.find(1)->second.update([](pair_of_ints& p) { ++p.a; ++p.b; });
+    }
+    done = true;
+    reader.join();
+    std::cout << "##########    The next non-debug line should read: >>> 0 100000" << std::endl;
+    std::cout << ">>> " << torn << " " << map5.at(1).load().b << std::endl;
+  }
+
+  // 8. Atomic value tests.
+  {
+    safe::map<int, number::atomic<int>> counters{{1, 0}};
+    std::vector<std::thread> bumpers;
+    for (int t = 0; t < 4; ++t)
+      bumpers.emplace_back([&counters]() {
+        auto iter = counters.find(1);
+        for (int i = 0; i < 10000; ++i)
+        {
+          counters.at(1) += 1;
+          iter->second.fetch_add(2);
+        }
+      });
+    for (auto& t : bumpers)
+      t.join();
+    int expected = counters.at(1);
+    const bool swapped = counters.at(1).compare_exchange_strong(expected, 7);
+    std::cout << "##########    The next non-debug line should read: >>> 120000 1 7" << std::endl;
+    std::cout << ">>> " << expected << " " << swapped << " " << counters.at(1) << std::endl;
+  }
+
+  // 9. Upsert tests.
+  {
+    typedef safe::map<int, MyValue> map_type;
+    map_type map6{{1, MyValue(1)}, {2, MyValue(2)}};
+    auto pinned = map6.find(2);
+    map6.erase(2);
+    auto bump = [](map_type::safe_mapped_type& v) { v += 10; };
+    const bool inserted1 = map6.upsert(1, bump).second;
+    const bool inserted2 = map6.upsert_fast(2, bump);
+    const bool inserted3 = map6.compute_if_absent(3, []() { return MyValue(3); }).second;
+    const bool inserted4 = map6.compute_if_absent_fast(3, []() { return MyValue(-3); });
+    const bool updated5 = map6.update_if_present(4, bump) != map6.end();
+    const bool updated6 = map6.update_if_present_fast(3, bump);
+    std::cout << "##########    The next non-debug line should read: >>> 0 1 1 0 0 1 | 11 10 13" << std::endl;
+    std::cout << ">>> " << inserted1 << " " << inserted2 << " " << inserted3 << " " << inserted4 << " " << updated5 << " " << updated6
+              << " | " << map6.at(1) << " " << map6.at(2) << " " << map6.at(3) << std::endl;
+#if __cplusplus >= 201703L
+    auto again = map6.find(2);
+    map6.erase(2);
+    map6.emplace(2, MyValue(20));
+    map6.erase(2);
+    std::string s = ">>> " + std::to_string(int(pinned->second)) + " " + std::to_string(int(again->second));
+    auto before = again;
+    --before;
+    ++again;
+    ++pinned;
+    s += " | " + std::to_string(before->first) + " " + std::to_string(again->first) + " " + std::to_string(pinned->first) + " | " + std::to_string(map6.size());
+    std::cout << "##########    The next non-debug line should read: >>> 2 10 | 1 3 3 | 2" << std::endl;
+    std::cout << s << std::endl;
+#endif
+  }
+
+  // 10. Multi-key lookup tests.
+  {
+    safe::map<int, MyValue> map7;
+    for (int i = 0; i < 100; i += 2)
+      map7.emplace(i, MyValue(i * 10));
+    map7.erase(40);
+    const std::vector<int> keys{2, 3, 4, 40, 42, 90, 98, 99};
+    std::vector<safe::map<int, MyValue>::iterator> iters;
+    std::vector<safe::map<int, MyValue>::value_type> values;
+    const auto found1 = map7.find_many(keys.begin(), keys.end(), iters);
+    const auto found2 = map7.find_many(keys.begin(), keys.end(), values);
+    std::cout << "##########    The next non-debug line should read: >>> 5 5 | 2 * 4 * 42 90 98 * | 20 40 420 900 980" << std::endl;
+    std::string s = ">>> " + std::to_string(found1) + " " + std::to_string(found2) + " | ";
+    for (auto& i : iters)
+      s += (i == map7.end() ? std::string("*") : std::to_string(i->first)) + " ";
+    s += "|";
+    for (auto& v : values)
+      s += " " + std::to_string(int(v.second));
+    std::cout << s << std::endl;
+  }
+
+  // 11. Nearby search tests.
+  {
+    safe::map<int, MyValue> map8;
+    for (int i = 0; i < 1000; i += 10)
+      map8.emplace(i, MyValue(i));
+    map8.erase(60);
+    auto iter = map8.find(30);
+    std::string s = ">>> ";
+    s += std::to_string(iter.seek(45)->first) + " ";
+    s += std::to_string(iter.seek(55)->first) + " ";
+    s += std::to_string(iter.seek(15)->first) + " ";
+    s += std::to_string(iter.seek(905)->first) + " ";
+    s += (iter.seek(2000) == map8.end() ? std::string("* ") : std::string("? "));
+    iter = map8.find(500);
+    s += "| " + std::to_string(map8.find_near(iter, 520)->first) + " ";
+    s += std::to_string(map8.find_near(iter, 100)->first) + " ";
+    s += (map8.find_near(iter, 515) == map8.end() ? std::string("*") : std::string("?"));
+    std::cout << "##########    The next non-debug line should read: >>> 50 70 20 910 * | 520 100 *" << std::endl;
+    std::cout << s << std::endl;
+  }
+
+#if __cplusplus >= 201703L
+  // 12. Node moving tests.
+  {
+    safe::map<int, MyValue> map9, map10;
+    for (int i = 1; i <= 6; ++i)
+      map9.emplace(i, MyValue(i));
+    map10.emplace(3, MyValue(30));
+    auto pinned = map9.find(5);
+    auto node = map9.extract(2);
+    map10.insert(std::move(node));
+    map10.merge(map9);
+    auto map11 = map10.split(4);
+    std::cout << "##########    The next non-debug line should read: >>> 1 | 1 2 3 | 4 5 6 | 30 5 2" << std::endl;
+    std::string s = ">>> " + std::to_string(map9.count(3)) + " |";
+    for (auto i = map10.begin(); i != map10.end(); ++i)
+      s += " " + std::to_string(i->first);
+    s += " |";
+    for (auto i = map11.begin(); i != map11.end(); ++i)
+      s += " " + std::to_string(i->first);
+    s += " | " + std::to_string(int(map10.at(3))) + " " + std::to_string(int(pinned->second)) + " " + std::to_string(map9.size());
+    std::cout << s << std::endl;
+  }
+#endif
+
+  // 13. Cross-map locking tests.
+  {
+    safe::map<int, MyValue> map12, map13;
+    for (int i = 0; i < 4; ++i)
+      map12.emplace(i, MyValue(i));
+    std::thread swapper([&]() { for (int i = 0; i < 1000; ++i) map13.swap(map12); });
+    for (int i = 0; i < 1000; ++i)
+      map12.swap(map13);
+    swapper.join();
+    map12 = map12;
+    std::cout << "##########    The next non-debug line should read: >>> 4 0 | 1 0 1 | 3 1 2" << std::endl;
+    std::string s = ">>> " + std::to_string(map12.size()) + " " + std::to_string(map13.size()) + " |";
+    s += " " + std::to_string(safe::map<int, MyValue>::move_entry(map12, map13, 2));
+    s += " " + std::to_string(safe::map<int, MyValue>::move_entry(map12, map13, 2));
+    s += " " + std::to_string(safe::map<int, MyValue>::move_entry(map12, map12, 1));
+    s += " | " + std::to_string(map12.size()) + " " + std::to_string(map13.size()) + " " + std::to_string(int(map13.at(2)));
+    std::cout << s << std::endl;
+  }
+
+  // 14. Change feed tests.
+  {
+    typedef safe::map<int, MyValue> map_type;
+    map_type map14;
+    auto feed = map14.subscribe(4, true);
+    auto drain = [&]() {
+      const char* kinds = "iuer";
+      std::string ret;
+      map_type::feed_type::event_type e;
+      while (feed->pop(e))
+        ret += std::string(" ") + kinds[int(e.kind)] + std::to_string(e.key) + "=" + std::to_string(int(e.value));
+      return ret;
+    };
+    map14.emplace(1, MyValue(10));
+    map14.emplace(2, MyValue(20));
+    map14.update_if_present_fast(2, [](map_type::safe_mapped_type& v) { v += 1; });
+    map14.erase_fast(1);
+    std::string s = ">>>" + drain() + " |";
+    map14.cleanup();
+    for (int i = 3; i <= 6; ++i)
+      map14.emplace(i, MyValue(i * 10));
+    s += drain() + " | " + std::to_string(feed->dropped());
+    map14.upsert_fast(7, [](map_type::safe_mapped_type& v) { v = 70; });
+    map14.erase_fast(7);
+    map14.erase_fast(7);
+    map14.clear_fast();
+    s += " |" + drain();
+    map14.emplace(8, MyValue(80));
+    map14.emplace(9, MyValue(90));
+    {
+      auto held = map14.find(8);
+      auto last = map14.rbegin();
+      map14.erase_fast(held);
+      map14.erase_fast(held);
+      map14.erase_fast(last);
+      s += " |" + drain() + " " + std::to_string((map14.find(8) == map14.end()) + (map14.find(9) == map14.end()));
+    }
+    map14.unsubscribe(feed);
+    map14.erase(2);
+    s += " " + std::to_string(feed->size());
+    std::cout << "##########    The next non-debug line should read: >>> i1=10 i2=20 u2=21 e1=10 | r1=10 i3=30 i4=40 i5=50 | 1 | i7=70 e7=70 e2=21 e3=30 | i8=80 i9=90 e8=80 e9=90 2 0" << std::endl;
+    std::cout << s << std::endl;
+  }
+
+  // 15. TTL tests.
+  {
+    typedef safe::map<int, MyValue> map_type;
+    map_type map15;
+    map15.emplace_with_ttl(1, MyValue(1), std::chrono::milliseconds(10));
+    map15.emplace_with_ttl(2, MyValue(2), std::chrono::milliseconds(10));
+    map15.emplace_with_ttl(3, MyValue(3), std::chrono::milliseconds(10));
+    map15.emplace_with_ttl(4, MyValue(4), std::chrono::milliseconds(5000));
+    map15.emplace(5, MyValue(5));
+    map15.set_ttl(2, std::chrono::milliseconds(5000));
+    map15.erase(3);
+    map15.emplace(3, MyValue(30));
+    size_t expired;
+    int pinned_value;
+    {
+      auto pinned = map15.find(1);
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      expired = map15.expire();
+      pinned_value = int(pinned->second);
+    }
+    std::cout << "##########    The next non-debug line should read: >>> 1 | 0 1 1 1 1 | 1" << std::endl;
+    std::cout << ">>> " << expired << " | " << map15.count(1) << " " << map15.count(2) << " " << map15.count(3) << " " << map15.count(4) << " " << map15.count(5) << " | " << pinned_value << std::endl;
+  }
+
+  // 16. Bounded map tests.
+  {
+    safe::map<int, MyValue> map16;
+    map16.set_capacity(3);
+    auto keys = [&]() {
+      std::string ret;
+      for (auto i = map16.begin(); i != map16.end(); ++i)
+        ret += " " + std::to_string(i->first);
+      return ret;
+    };
+    for (int i = 1; i <= 3; ++i)
+      map16.emplace(i, MyValue(i));
+    map16.find(1);
+    map16.emplace(4, MyValue(4));
+    std::string s = ">>>" + keys() + " |";
+    {
+      auto pinned = map16.find(3);
+      map16.emplace(5, MyValue(5));
+      s += keys() + " |";
+    }
+    map16.emplace(6, MyValue(6));
+    s += keys();
+    std::cout << "##########    The next non-debug line should read: >>> 1 3 4 | 1 3 5 | 1 3 6" << std::endl;
+    std::cout << s << std::endl;
+  }
+
+  // 17. Admission tests.
+  {
+    safe::map<int, MyValue> map17;
+    map17.set_capacity(3);
+    map17.enable_admission();
+    auto keys = [&]() {
+      std::string ret;
+      for (auto i = map17.begin(); i != map17.end(); ++i)
+        ret += " " + std::to_string(i->first);
+      return ret;
+    };
+    for (int i = 1; i <= 3; ++i)
+    {
+      map17.emplace(i, MyValue(i));
+      for (int j = 0; j < 3; ++j)
+        map17.find(i);
+    }
+    int admitted = 0;
+    for (int i = 10; i < 20; ++i)
+      admitted += map17.emplace(i, MyValue(i)).second;
+    std::string s = ">>> " + std::to_string(admitted) + " |" + keys() + " | ";
+    int attempts = 1;
+    while (!map17.emplace(20, MyValue(20)).second)
+      ++attempts;
+    s += std::to_string(attempts) + " |" + keys();
+    std::cout << "##########    The next non-debug line should read: >>> 0 | 1 2 3 | 4 | 2 3 20" << std::endl;
+    std::cout << s << std::endl;
+  }
+
+  // 18. Negative filter tests.
+  {
+    safe::map<int, MyValue> map18;
+    map18.enable_negative_filter();
+    for (int i = 0; i < 2000; i += 2)
+      map18.emplace(i, MyValue(i));
+    bool threw = false;
+    try { map18.at(11); } catch (std::out_of_range&) { threw = true; }
+    std::string s = ">>> " + std::to_string(map18.count(10)) + " " + std::to_string(map18.count(11)) + " " + std::to_string(threw) + " |";
+    for (int i = 2000; i < 20000; i += 2)
+      map18.emplace(i, MyValue(i));
+    map18.erase(10);
+    map18.cleanup();
+    size_t found = 0, missing = 0;
+    for (int i = 0; i < 20000; ++i)
+      if (i % 2)
+        missing += (map18.find(i) == map18.end());
+      else
+        found += map18.count(i);
+    s += " " + std::to_string(found) + " " + std::to_string(missing);
+    std::cout << "##########    The next non-debug line should read: >>> 1 0 1 | 9999 10000" << std::endl;
+    std::cout << s << std::endl;
+  }
+
+  // 19. Cached lookup tests.
+  {
+    safe::map<int, MyValue> map19;
+    for (int i = 0; i < 10; ++i)
+      map19.emplace(i, MyValue(i));
+    auto a = map19.find_cached(5);
+    auto b = map19.find_cached(5);
+    std::string s = ">>> " + std::to_string(a == b) + " " + std::to_string(int(b->second)) + " |";
+    map19.erase(5);
+    s += " " + std::to_string(map19.find_cached(5) == map19.end()) + " |";
+    map19.emplace(5, MyValue(50));
+    a = map19.find_cached(5);
+    map19.emplace(20, MyValue(20));
+    s += " " + std::to_string(int(map19.find_cached(5)->second)) + " " + std::to_string(int(map19.find_cached(20)->second));
+    std::cout << "##########    The next non-debug line should read: >>> 1 5 | 1 | 50 20" << std::endl;
+    std::cout << s << std::endl;
+  }
+
+  // 20. Serialization tests.
+  {
+    safe::map<int, int> map20;
+    for (int i = 0; i < 10000; ++i)
+      map20.emplace(i * 3, -i);
+    map20.erase(3);
+    std::stringstream dump;
+    map20.serialize(dump);
+    safe::map<int, int> map21{{1, 1}};
+    const bool loaded = map21.deserialize(dump);
+    safe::map<std::string, long> map22{{"pi", 314159}, {"e", 271828}}, map23;
+    std::stringstream dump2;
+    map22.serialize(dump2);
+    map23.deserialize(dump2);
+    std::stringstream junk("not a dump");
+    std::string huge = dump2.str();	// Claims a 4 GiB key
+    const size_t length = huge.find(std::string("\0\0\0\1e", 5));
+    if (length != std::string::npos)
+      huge.replace(length, 4, "\xff\xff\xff\xf0");
+    std::stringstream truncated(huge);
+    std::cout << "##########    The next non-debug line should read: >>> 1 9999 0 0 -9999 | 2 314159 | 0 2 0" << std::endl;
+    std::cout << ">>> " << loaded << " " << map21.size() << " " << map21.count(1) << " " << map21.count(3) << " " << int(map21.at(29997)) << " | " << map23.size() << " " << long(map23.at("pi")) << " | " << map23.deserialize(junk) << " " << map23.size() << " " << map23.deserialize(truncated) << std::endl;
+  }
+
+  // 21. Raw number serialization tests.
+  {
+    number::base<int> one(-2);
+    char b[4];
+    one.serialize_into(b);
+    number::base<int> values[100], copies[100];
+    for (int i = 0; i < 100; ++i)
+      values[i] = number::base<int>(i * 1000003);
+    char batch[400];
+    const size_t written = number::base<int>::serialize_into(values, 100, batch);
+    number::base<int>::deserialize_from(copies, 100, batch);
+    bool same = one.serialize() == std::string(b, 4) && values[57].serialize() == std::string(batch + 57 * 4, 4);
+    for (int i = 0; i < 100; ++i)
+      same = same && copies[i].var == values[i].var;
+    number::base<long long> wide;
+    wide.deserialize_from(number::base<long long>(0x0102030405060708LL).serialize().data());
+    std::cout << "##########    The next non-debug line should read: >>> 400 1 1 72623859790382856" << std::endl;
+    std::cout << ">>> " << written << " " << same << " " << int(b[0] == char(0xff) && b[3] == char(0xfe)) << " " << wide.var << std::endl;
+  }
+
+  // 22. Compact encoding tests.
+  {
+    number::base<long long> small(-3), big(-9000000000000000000LL), back;
+    char b[10];
+    const int bytes = big.serialize_compact_into(b);
+    back.deserialize_compact_from(b, bytes);
+    number::base<unsigned char> narrow;
+    const int overflow = narrow.deserialize_compact(number::base<int>(300).serialize_compact());
+    safe::map<long, long> map24, map25;
+    for (long i = 0; i < 10000; ++i)
+      map24.emplace(1000000 + i * 7, i % 100 - 50);
+    std::stringstream fixed, compact;
+    map24.serialize(fixed);
+    map24.serialize(compact, safe::serial_format::compact);
+    const bool loaded = map25.deserialize(compact);
+    std::cout << "##########    The next non-debug line should read: >>> 1 10 1 0 1 1 10000 -50 1" << std::endl;
+    std::cout << ">>> " << small.serialize_compact().size() << " " << bytes << " " << (back.var == big.var) << " " << overflow << " " << loaded << " " << (compact.str().size() * 5 < fixed.str().size()) << " " << map25.size() << " " << long(map25.at(1000000)) << " " << (map25.find(1069993)->second == 49) << std::endl;
+  }
+
+  // 23. Checkpoint file tests.
+  {
+    const std::string path = "/tmp/safemap_test." + std::to_string(getpid());
+    safe::map<int, int> map26{{1, 10}, {2, 20}}, map27;
+    const bool saved = map26.save(path);
+    map26.emplace(3, 30);
+    const bool resaved = map26.save(path, safe::serial_format::compact);
+    const bool loaded = map27.load(path);
+    const bool missing = map27.load(path + ".missing");
+    remove(path.c_str());
+    std::cout << "##########    The next non-debug line should read: >>> 1 1 1 0 3 30" << std::endl;
+    std::cout << ">>> " << saved << " " << resaved << " " << loaded << " " << missing << " " << map27.size() << " " << int(map27.at(3)) << std::endl;
+  }
+
+  // 24. Journal tests.
+  {
+    const std::string log = "/tmp/safemap_test_log." + std::to_string(getpid()), checkpoint = log + ".checkpoint";
+    {
+      safe::map<int, int> map28;
+      map28.enable_journal(log);
+      std::vector<std::thread> writers;
+      for (int t = 0; t < 4; ++t)
+        writers.emplace_back([&map28, t]() {
+          for (int i = 0; i < 100; ++i)
+          {
+            map28.emplace(t * 100 + i, i);
+            map28.sync();
+          }
+        });
+      for (auto& t : writers)
+        t.join();
+      map28.erase(0);
+      map28.checkpoint(checkpoint);
+      map28.erase(1);
+      map28.upsert(2, [](number::weak<int>& v) { v = 22; });
+      map28.upsert(1000, [](number::weak<int>& v) { v = 7; });
+      map28[1001] = 5;
+      map28.disable_journal();
+    }
+    safe::map<int, int> map29;
+    const bool loaded = map29.load(checkpoint);
+    const bool replayed = map29.enable_journal(log);
+    map29.disable_journal();
+    remove(log.c_str());
+    remove(checkpoint.c_str());
+    std::cout << "##########    The next non-debug line should read: >>> 1 1 399 0 0 22 | 7 0" << std::endl;
+    std::cout << ">>> " << loaded << " " << replayed << " " << map29.size() << " " << map29.count(0) << " " << map29.count(1) << " " << int(map29.at(2))
+              << " | " << int(map29.at(1000)) << " " << map29.count(1001) << std::endl;
+  }
+
+  // 25. Background checkpoint tests.
+  {
+    const std::string path = "/tmp/safemap_test_checkpoint." + std::to_string(getpid());
+    safe::map<int, int> map30, map31;
+    for (int i = 0; i < 20000; ++i)
+      map30.emplace(i, i);
+    auto done = map30.checkpoint_async(path);
+    for (int i = 0; i < 20000; ++i)
+    {
+      map30.erase(i);
+      map30.emplace(i + 20000, -i);
+      map30.upsert(19999 - i, [](number::weak<int>& v) { v = -1; });
+    }
+    const bool written = done.get();
+    map31.load(path);
+    safe::map<int, int>* doomed = new safe::map<int, int>;	// Destroyed with the checkpoint still running
+    for (int i = 0; i < 200000; ++i)
+      doomed->emplace(i, i);
+    auto orphaned = doomed->checkpoint_async(path);
+    delete doomed;
+    const bool doomed_written = orphaned.get();
+    safe::map<int, int> reloaded;
+    reloaded.load(path);
+    remove(path.c_str());
+    std::cout << "##########    The next non-debug line should read: >>> 1 20000 0 19999 0 | 1 200000" << std::endl;
+    std::cout << ">>> " << written << " " << map31.size() << " " << int(map31.at(0)) << " " << int(map31.at(19999)) << " " << map31.count(20000) << " | " << doomed_written << " " << reloaded.size() << std::endl;
+  }
+
+  // 26. Mapped load tests.
+  {
+    const std::string path = "/tmp/safemap_test_load." + std::to_string(getpid());
+    safe::map<int, std::string> map32, map33{{7, "seven"}};
+    for (int i = 0; i < 100000; ++i)
+      map32.emplace(i, std::to_string(i));
+    map32.save(path);
+    const bool loaded = map33.load(path);
+    std::ofstream(path, std::ios::trunc) << "SAFEMAP1 but then garbage";
+    const bool garbage = map33.load(path);
+    std::ofstream(path, std::ios::trunc);
+    const bool empty = map33.load(path);
+    remove(path.c_str());
+    std::cout << "##########    The next non-debug line should read: >>> 1 0 0 100000 99999" << std::endl;
+    std::cout << ">>> " << loaded << " " << garbage << " " << empty << " " << map33.size() << " " << std::string(map33.at(99999)) << std::endl;
+  }
+
+  // 27. Partitioned export tests.
+  {
+    const std::string dir = "/tmp/safemap_test_parts." + std::to_string(getpid());
+    mkdir(dir.c_str(), 0755);
+    safe::map<int, int> map34;
+    for (int i = 0; i < 10000; ++i)
+      map34.emplace(i, i);
+    const bool exported = map34.export_partitioned(dir, 3);
+    std::string sizes;
+    int lowest = 0;
+    for (int part = 0; part < 3; ++part)
+    {
+      const std::string path = dir + "/part-0000" + std::to_string(part) + ".dump";
+      safe::map<int, int> map35;
+      map35.load(path);
+      sizes += std::to_string(map35.size()) + " ";
+      lowest += map35.begin()->first;
+      remove(path.c_str());
+    }
+    auto pinned = map34.find(3333);	// The second part's first key, erased and put back while held
+    map34.erase(3333);
+    map34.emplace(3333, -1);
+    std::atomic<bool> churning(true);
+    std::thread churn([&map34, &churning]() {
+      while (churning)
+        for (int i = 0; i < 10000; i += 500)
+        {
+          auto held = map34.find(i);
+          map34.erase(i);
+          map34.emplace(i, i);
+        }
+    });
+    const bool reexported = map34.export_partitioned(dir, 3);
+    churning = false;
+    churn.join();
+    std::map<int, int> seen;
+    bool ordered = true;
+    int highest = -1, boundary = 0;
+    for (int part = 0; part < 3; ++part)
+    {
+      const std::string path = dir + "/part-0000" + std::to_string(part) + ".dump";
+      safe::map<int, int> map35;
+      map35.load(path);
+      for (auto i = map35.begin(); i != map35.end(); ++i)
+      {
+        ordered = ordered && (i->first > highest);
+        highest = i->first;
+        ++seen[i->first];
+        if (i->first == 3333)
+          boundary = i->second;
+      }
+      remove(path.c_str());
+    }
+    rmdir(dir.c_str());
+    size_t steady = 0;	// Keys the churn never touched, each in exactly one part
+    for (auto& i : seen)
+      steady += (i.first % 500) && (i.second == 1);
+    std::cout << "##########    The next non-debug line should read: >>> 1 3333 3333 3334 9999 | 1 1 9980 1 -1" << std::endl;
+    std::cout << ">>> " << exported << " " << sizes << lowest << " | " << reexported << " " << ordered << " " << steady << " " << seen.count(3333) << " " << boundary << std::endl;
+  }
+
+  // 28. Now, the big part: the threaded stress tests. 
 
   map.clear();
 
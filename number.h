@@ -6,8 +6,16 @@
 
 #include <iostream>
 #include <string>
+#include <atomic>
+#include <type_traits>
+#include <limits>
 
 #include <stdint.h>
+#include <string.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
 
 namespace number {
 
@@ -31,6 +39,176 @@ namespace number {
     #error "I don't know what architecture this is!"
 #endif
 
+// H E L P E R S //////////////////////////////////////////////////////////////
+
+inline uint16_t bswap16(const uint16_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_bswap16(v);
+#else
+  return uint16_t(v << 8 | v >> 8);
+#endif
+}
+
+inline uint32_t bswap32(const uint32_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_bswap32(v);
+#else
+  return (v << 24) | ((v << 8) & 0xff0000) | ((v >> 8) & 0xff00) | (v >> 24);
+#endif
+}
+
+inline uint64_t bswap64(const uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_bswap64(v);
+#else
+  return (uint64_t(bswap32(uint32_t(v))) << 32) | bswap32(uint32_t(v >> 32));
+#endif
+}
+
+template <size_t N>
+struct byte_swap	// Copies N-byte values while reversing their bytes
+{
+  static void copy(char* out, const char* in)
+  {
+    if (N == 2 || N == 4 || N == 8)	// One bswap instruction each; the other branches fold away
+    {
+      uint64_t u = 0;
+      const size_t n = N < sizeof(u) ? N : sizeof(u);	// Keeps the dead branch in bounds for N > 8
+      memcpy(&u, in, n);
+      if (N == 2) u = bswap16(uint16_t(u));
+      if (N == 4) u = bswap32(uint32_t(u));
+      if (N == 8) u = bswap64(u);
+      memcpy(out, &u, n);
+    }
+    else
+      for (size_t i = 0; i < N; ++i)
+        out[i] = in[N - i - 1];
+  };
+
+  static void copy_n(char* out, const char* in, const size_t count)	// count consecutive values
+  {
+    size_t i = 0;
+#if defined(__SSSE3__)
+    if (N == 2 || N == 4 || N == 8)	// 16 bytes per shuffle
+    {
+      char order[16];
+      for (size_t b = 0; b < 16; ++b)
+        order[b] = char(b / N * N + N - 1 - b % N);
+      const __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i*>(order));
+      for (; i + 16 / N <= count; i += 16 / N)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * N),
+          _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i * N)), mask));
+    }
+#endif
+    for (; i < count; ++i)
+      copy(out + i * N, in + i * N);
+  };
+};
+
+// Compact encoding: LEB128 varints, seven bits a byte, low bits first, with
+// the top bit set on every byte but the last.  Signed values are zigzagged
+// first (0, -1, 1, -2 ... become 0, 1, 2, 3 ...) so small negatives stay short.
+const int varint_max_size = 10;
+
+inline uint64_t zigzag_encode(const int64_t v) { return (uint64_t(v) << 1) ^ uint64_t(v >> 63); }
+inline int64_t zigzag_decode(const uint64_t v) { return int64_t(v >> 1) ^ -int64_t(v & 1); }
+
+inline int ctz64(const uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(v);
+#else
+  int n = 0;
+  while (!((v >> n) & 1))
+    ++n;
+  return n;
+#endif
+}
+
+inline int varint_encode(uint64_t v, char* out)	// Returns the bytes written, at most varint_max_size
+{
+  int n = 0;
+  for (; v >= 0x80; v >>= 7)
+    out[n++] = char(v | 0x80);
+  out[n++] = char(v);
+  return n;
+}
+
+inline int varint_decode(const char* in, const size_t available, uint64_t& v)	// Bytes read, or 0 if truncated or too long
+{
+  if (available >= 8)
+  {
+    uint64_t word;
+    memcpy(&word, in, 8);
+#if IS_BIG_ENDIAN == 1
+    word = bswap64(word);
+#endif
+    const uint64_t stops = ~word & 0x8080808080808080ULL;
+    if (stops)	// It ends within these 8 bytes, so gather the 7-bit groups in a few steps rather than a loop
+    {
+      const int n = (ctz64(stops) >> 3) + 1;
+      if (n < 8)
+        word &= (uint64_t(1) << (8 * n)) - 1;
+      word &= 0x7f7f7f7f7f7f7f7fULL;
+      word = ((word & 0x7f007f007f007f00ULL) >> 1) | (word & 0x007f007f007f007fULL);
+      word = ((word & 0x3fff00003fff0000ULL) >> 2) | (word & 0x00003fff00003fffULL);
+      word = ((word & 0x0fffffff00000000ULL) >> 4) | (word & 0x000000000fffffffULL);
+      v = word;
+      return n;
+    }
+  }
+  v = 0;
+  for (size_t i = 0; (i < available) && (i < size_t(varint_max_size)); ++i)
+  {
+    const uint64_t b = static_cast<unsigned char>(in[i]);
+    if ((i == 9) && (b > 1))	// More than 64 bits
+      return 0;
+    v |= (b & 0x7f) << (7 * i);
+    if (!(b & 0x80))
+      return int(i) + 1;
+  }
+  return 0;
+}
+
+template <class T> inline uint64_t compact_encode(const T v, std::true_type) { return zigzag_encode(int64_t(v)); }
+template <class T> inline uint64_t compact_encode(const T v, std::false_type) { return uint64_t(v); }
+
+template <class T>
+inline uint64_t compact_encode(const T v)	// The integer a value's varint holds
+{
+  static_assert(std::is_integral<T>::value, "compact encoding is for integer types");
+  return compact_encode(v, std::is_signed<T>());
+}
+
+template <class T>
+inline bool compact_decode(const uint64_t u, T& v, std::true_type)
+{
+  const int64_t z = zigzag_decode(u);
+  if ((z < int64_t(std::numeric_limits<T>::min())) || (z > int64_t(std::numeric_limits<T>::max())))
+    return false;
+  v = T(z);
+  return true;
+}
+
+template <class T>
+inline bool compact_decode(const uint64_t u, T& v, std::false_type)
+{
+  if (u > uint64_t(std::numeric_limits<T>::max()))
+    return false;
+  v = T(u);
+  return true;
+}
+
+template <class T>
+inline bool compact_decode(const uint64_t u, T& v)	// False if it doesn't fit in a T
+{
+  static_assert(std::is_integral<T>::value, "compact encoding is for integer types");
+  return compact_decode(u, v, std::is_signed<T>());
+}
+
 // C L A S S E S //////////////////////////////////////////////////////////////
 
 template <class T>
@@ -48,31 +226,98 @@ public:
   explicit operator std::string() const { return std::to_string(var); };
   static int size() { return sizeof(T); };
   std::string serialize() const
-  { 
+  {
+    char b[sizeof(var)];
+    serialize_into(b);
+    return std::string(b, sizeof(var));
+  };
+
+  int deserialize(const std::string& s) { return deserialize_from(s.data()); };
+
+  // These write and read size() big-endian bytes without allocating; the caller owns the buffer.
+  int serialize_into(char* out) const
+  {
 #if IS_BIG_ENDIAN == 1
-    return std::string(reinterpret_cast<const char*>(&var), sizeof(var));
+    memcpy(out, &var, sizeof(var));
 #else
-    char endian_converted[sizeof(var)];
-    auto s = reinterpret_cast<const char*>(&var);
-    for (unsigned int i = 0; i < sizeof(var); ++i)
-      endian_converted[i] = s[sizeof(var) - i - 1];
-    return std::string(endian_converted, sizeof(var));
+    byte_swap<sizeof(var)>::copy(out, reinterpret_cast<const char*>(&var));
 #endif
+    return sizeof(var);
   };
 
-  int deserialize(const std::string& s)
+  int deserialize_from(const char* in)
   {
 #if IS_BIG_ENDIAN == 1
-    var=*(reinterpret_cast<const T*>(s.data()));
+    memcpy(&var, in, sizeof(var));
 #else
-    char endian_converted[sizeof(var)];
-    for (unsigned int i = 0; i < sizeof(var); ++i)
-      endian_converted[i] = s[sizeof(var) - i - 1];
-    var=*(reinterpret_cast<T*>(endian_converted));
+    byte_swap<sizeof(var)>::copy(reinterpret_cast<char*>(&var), in);
 #endif
     return sizeof(var);
   };
 
+  // Batch forms for count values in a row; they return the number of bytes written or read.
+  static size_t serialize_into(const base<T>* values, const size_t count, char* out)
+  {
+    if (sizeof(base<T>) == sizeof(T))
+#if IS_BIG_ENDIAN == 1
+      memcpy(out, values, count * sizeof(T));
+#else
+      byte_swap<sizeof(T)>::copy_n(out, reinterpret_cast<const char*>(values), count);
+#endif
+    else
+      for (size_t i = 0; i < count; ++i)
+        values[i].serialize_into(out + i * sizeof(T));
+    return count * sizeof(T);
+  };
+
+  static size_t deserialize_from(base<T>* values, const size_t count, const char* in)
+  {
+    if (sizeof(base<T>) == sizeof(T))
+#if IS_BIG_ENDIAN == 1
+      memcpy(values, in, count * sizeof(T));
+#else
+      byte_swap<sizeof(T)>::copy_n(reinterpret_cast<char*>(values), in, count);
+#endif
+    else
+      for (size_t i = 0; i < count; ++i)
+        values[i].deserialize_from(in + i * sizeof(T));
+    return count * sizeof(T);
+  };
+
+  // Compact form, for integer types only: the value as a varint, zigzagged
+  // if signed, so small magnitudes take a byte or two (at most compact_size()).
+  static int compact_size() { return (sizeof(T) * 8 + 6) / 7; };
+  int serialize_compact_into(char* out) const { return varint_encode(compact_encode(var), out); };
+  std::string serialize_compact() const { char b[varint_max_size]; const int n = serialize_compact_into(b); return std::string(b, n); };
+  int deserialize_compact_from(const char* in, const size_t available)	// Bytes read, or 0 if malformed
+  {
+    uint64_t u;
+    const int n = varint_decode(in, available, u);
+    return (n && compact_decode(u, var)) ? n : 0;
+  };
+  int deserialize_compact(const std::string& s) { return deserialize_compact_from(s.data(), s.size()); };
+
+  static size_t serialize_compact_into(const base<T>* values, const size_t count, char* out)
+  {
+    size_t n = 0;
+    for (size_t i = 0; i < count; ++i)
+      n += values[i].serialize_compact_into(out + n);
+    return n;
+  };
+
+  static size_t deserialize_compact_from(base<T>* values, const size_t count, const char* in, const size_t available)	// 0 if malformed
+  {
+    size_t n = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+      const int read = values[i].deserialize_compact_from(in + n, available - n);
+      if (!read)
+        return 0;
+      n += read;
+    }
+    return n;
+  };
+
   T var;
 };
 
@@ -161,6 +406,77 @@ public:
   DECLARE_UNARY_CONST(~);
   DECLARE_UNARY_CONST(!);
 };
+
+template <class T>
+class atomic	// Like weak, but every read-modify-write is a single atomic operation
+{
+public:
+  atomic() : var(T()) { };
+  atomic(const atomic<T>& _var) : var(_var.load()) { };
+  atomic(const T _var) : var(_var) { };
+  ~atomic() { };
+
+  operator T() const { return load(); };
+  atomic<T>& operator=(const atomic<T>& rhs) { store(rhs.load()); return *this; };
+  atomic<T>& operator=(const T rhs) { store(rhs); return *this; };
+  explicit operator std::string() const { return std::to_string(load()); };
+  static int size() { return sizeof(T); };
+  std::string serialize() const { return base<T>(load()).serialize(); };
+  int deserialize(const std::string& s) { base<T> tmp; const int ret = tmp.deserialize(s); store(tmp.var); return ret; };
+  int serialize_into(char* out) const { return base<T>(load()).serialize_into(out); };
+  int deserialize_from(const char* in) { base<T> tmp; const int ret = tmp.deserialize_from(in); store(tmp.var); return ret; };
+  int serialize_compact_into(char* out) const { return base<T>(load()).serialize_compact_into(out); };
+  int deserialize_compact_from(const char* in, const size_t available)
+    { base<T> tmp; const int ret = tmp.deserialize_compact_from(in, available); if (ret) store(tmp.var); return ret; };
+
+  T load(const std::memory_order order = std::memory_order_seq_cst) const { return var.load(order); };
+  void store(const T i, const std::memory_order order = std::memory_order_seq_cst) { var.store(i, order); };
+  T exchange(const T i, const std::memory_order order = std::memory_order_seq_cst) { return var.exchange(i, order); };
+  bool compare_exchange_weak(T& expected, const T desired, const std::memory_order order = std::memory_order_seq_cst)
+    { return var.compare_exchange_weak(expected, desired, order); };
+  bool compare_exchange_strong(T& expected, const T desired, const std::memory_order order = std::memory_order_seq_cst)
+    { return var.compare_exchange_strong(expected, desired, order); };
+
+  // The fetch_* functions return the value from before the operation, as with std::atomic.
+  // Floating point types have no native fetch_add/fetch_sub, so those go through a CAS loop.
+  T fetch_add(const T i) { return fetch_add(i, std::is_integral<T>()); };
+  T fetch_sub(const T i) { return fetch_sub(i, std::is_integral<T>()); };
+  T fetch_and(const T i) { return var.fetch_and(i); };
+  T fetch_or(const T i) { return var.fetch_or(i); };
+  T fetch_xor(const T i) { return var.fetch_xor(i); };
+  template <class F> T fetch_apply(F f)	// Atomically replaces the value v with f(v)
+  {
+    T old = var.load(std::memory_order_relaxed);
+    while (!var.compare_exchange_weak(old, f(old)))
+      ;
+    return old;
+  };
+
+  // The compound assignments return the new value, as with std::atomic.
+  T operator+=(const T i) { return fetch_add(i) + i; };
+  T operator-=(const T i) { return fetch_sub(i) - i; };
+  T operator&=(const T i) { return fetch_and(i) & i; };
+  T operator|=(const T i) { return fetch_or(i) | i; };
+  T operator^=(const T i) { return fetch_xor(i) ^ i; };
+  T operator*=(const T i) { return fetch_apply([i](const T v) { return v * i; }) * i; };
+  T operator/=(const T i) { return fetch_apply([i](const T v) { return v / i; }) / i; };
+  T operator%=(const T i) { return fetch_apply([i](const T v) { return v % i; }) % i; };
+  T operator<<=(const T i) { return fetch_apply([i](const T v) { return v << i; }) << i; };
+  T operator>>=(const T i) { return fetch_apply([i](const T v) { return v >> i; }) >> i; };
+  T operator++() { return fetch_add(1) + 1; };
+  T operator--() { return fetch_sub(1) - 1; };
+  T operator++(int) { return fetch_add(1); };
+  T operator--(int) { return fetch_sub(1); };
+
+protected:
+  T fetch_add(const T i, std::true_type) { return var.fetch_add(i); };
+  T fetch_add(const T i, std::false_type) { return fetch_apply([i](const T v) { return v + i; }); };
+  T fetch_sub(const T i, std::true_type) { return var.fetch_sub(i); };
+  T fetch_sub(const T i, std::false_type) { return fetch_apply([i](const T v) { return v - i; }); };
+
+  std::atomic<T> var;
+};
+
 /*
 template <class T>
 class strong : public base<T>
@@ -16,16 +16,32 @@ License: Public domain
 #include <string>
 #include <map>
 #include <thread>
+#include <chrono>
 #include <mutex>
+#include <condition_variable>
+#include <future>
 #include <algorithm>
 #include <type_traits>
 #include <atomic>
 #include <memory>
 #include <deque>
+#include <array>
+#include <vector>
+#include <functional>
+#include <stdexcept>
+#include <istream>
+#include <ostream>
+#include <fstream>
 
 #include <assert.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
 
 #include "number.h"
 
@@ -175,1377 +191,4381 @@ public:
 };
 #endif
 
-template <class T>
-class mapped : public T	// Helper class for map - adds in the reference counter and erasure flag
+// Locks several mutexes for the life of the object.  They're always taken in
+// address order, so two threads locking the same set in opposite orders (a = b
+// against b = a) can't deadlock, and a mutex passed twice is only locked once.
+template <class Mutex, size_t N>
+class multi_guard
 {
 public:
+  template <class... M>
+  multi_guard(M&... m) :
+    m_locks{{&m...}}
+  {
+    static_assert(sizeof...(M) == N, "multi_guard needs exactly N mutexes");
+    std::sort(m_locks.begin(), m_locks.end(), std::less<Mutex*>());
+    for (size_t i = 0; i < N; ++i)
+      if (!i || (m_locks[i] != m_locks[i - 1]))
+        m_locks[i]->lock();
+  };
 
-  template <class U>
-  mapped(U rhs) :
-    T(rhs),
-    _reference_count(0),
-    _erase_when_unused(false)
+  ~multi_guard()
+  {
+    for (size_t i = N; i--; )
+      if (!i || (m_locks[i] != m_locks[i - 1]))
+        m_locks[i]->unlock();
+  };
+
+  multi_guard(const multi_guard&) = delete;
+  multi_guard& operator=(const multi_guard&) = delete;
+
+private:
+  std::array<Mutex*, N> m_locks;
+};
+
+enum class change_kind { inserted, updated, erased, reclaimed };
+
+enum class serial_format { fixed, compact };	// For map::serialize()
+
+template <class key_type, class mapped_type>
+struct change_event
+{
+  change_kind kind;
+  key_type key;
+  bool has_value;	// Only if the feed was asked for values; for erasures it's the last value
+  mapped_type value;
+};
+
+// One subscriber's view of a map's changes: a fixed-size ring written by the
+// map (always under its lock, so there's only ever one producer) and read by
+// a single consumer thread, with no locking on either side.  A full ring
+// never holds the writer up - the event is dropped and counted instead, and a
+// consumer that sees dropped() go up should resync from a snapshot().
+template <class key_type, class mapped_type>
+class change_feed
+{
+public:
+  typedef change_event<key_type, mapped_type> event_type;
+
+  change_feed(size_t capacity, bool with_values) :
+    m_slots(round_up(capacity)),
+    m_mask(m_slots.size() - 1),
+    m_with_values(with_values),
+    m_head(0),
+    m_tail(0),
+    m_dropped(0)
+    {};
+
+  bool pop(event_type& e)
+  {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail.load(std::memory_order_acquire))
+      return false;
+    e = std::move(m_slots[head & m_mask]);
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+  };
+
+  size_t size() const { return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire); };
+  size_t dropped() const { return m_dropped.load(std::memory_order_relaxed); };
+
+  template <class V> void push(change_kind kind, const key_type& k, const V& v)
+  {
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head.load(std::memory_order_acquire) > m_mask)
     {
-      DEBUG_THIS;
+      m_dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
     }
+    event_type& slot = m_slots[tail & m_mask];
+    slot.kind = kind;
+    slot.key = k;
+    slot.has_value = m_with_values;
+    if (m_with_values)
+      slot.value = mapped_type(static_cast<const mapped_type&>(v));
+    m_tail.store(tail + 1, std::memory_order_release);
+  };
 
-  mapped() :
-    _reference_count(0),
-    _erase_when_unused(false)
-    {
-      DEBUG_THIS;
-    };
+private:
+  static size_t round_up(size_t n)
+  {
+    size_t ret = 2;
+    while (ret < n)
+      ret <<= 1;
+    return ret;
+  };
 
-  mapped(mapped<T>&& rhs) :	// Don't steal reference counts - each object has to be unique, even if copied.
-    T(std::move(rhs)),
-    _reference_count(0),
-    _erase_when_unused(false)
-    {
-      DEBUG_THIS;
-    };
+  std::vector<event_type> m_slots;
+  const size_t m_mask;
+  const bool m_with_values;
+  std::atomic<size_t> m_head;	// Consumer's
+  char pad[64 - sizeof(std::atomic<size_t>)];	// Keep producer and consumer off each other's cache line
+  std::atomic<size_t> m_tail;	// Producer's
+  std::atomic<size_t> m_dropped;
+};
 
-  mapped(T&& rhs) : 
-    T(std::move(rhs)),
-    _reference_count(0),
-    _erase_when_unused(false)
-    {
-      DEBUG_THIS;
-    };
- 
-  mapped(const T& rhs) : 
-    T(rhs),
-    _reference_count(0),
-    _erase_when_unused(false)
-    {
-      DEBUG_THIS;
-    };
-  
-  mapped(const mapped<T>& rhs) : 
-    T(rhs),
-    _reference_count(0),
-    _erase_when_unused(false)
-    {
-      DEBUG_THIS;
-    };
-  
-  template <class U>
-  mapped<T>& operator=(U rhs)
+// Hierarchical timing wheel.  Level 0 has a slot per tick, and each level
+// above has slots 64 times as wide as the one below; as time reaches a slot
+// on a higher level, its timers are spread down into the finer levels.  So
+// scheduling is O(1), and advancing costs the timers that come due plus the
+// (amortised, bounded by the level count) cost of moving them down.
+// Deadlines further out than the top level reaches just go round it again.
+// A timer that's no longer wanted can't be found to take it out; cancel()
+// just stops it counting, and it's dropped when it comes due.
+template <class T>
+class timer_wheel
+{
+public:
+  timer_wheel(uint64_t now = 0) :
+    m_now(now),
+    m_count(0),
+    m_stored(0)
+    {};
+
+  uint64_t now() const { return m_now; };
+  size_t size() const { return m_count; };
+
+  void schedule(const T& item, uint64_t deadline)
   {
-    DEBUG_THIS;
-    T::operator=(rhs);
-    return *this;
+    place(item, std::max(deadline, m_now + 1));
+    ++m_count;
+    ++m_stored;
   };
 
-  mapped<T>& operator=(T&& rhs)
+  void cancel()
   {
-    DEBUG_THIS;
-    T::operator=(std::move(rhs));
-    return *this;
+    if (m_count && !--m_count)
+      clear();	// Whatever's left is stale
   };
 
-  mapped<T>& operator=(mapped<T>&& rhs)
+  // Moves time on to now, calling f(item, deadline) for each timer due by
+  // then; f returns false for a stale one that was cancel()ed already.  Time
+  // jumps straight to the next tick with a slot to visit, so the empty
+  // stretches in between cost nothing.
+  template <class F> void advance(uint64_t now, F f)
   {
-    DEBUG_THIS;
-    ASSERT(!_reference_count);
-    _reference_count = rhs._reference_count;
-    _erase_when_unused = rhs._erase_when_unused;
-    T::operator=(std::move(rhs));
-    return *this;
+    while ((m_now < now) && m_count)
+    {
+      m_now = std::min(next_visit(), now);
+      int level = 0;
+      while ((level + 1 < levels) && !(m_now & ((uint64_t(1) << (slot_bits * (level + 1))) - 1)))
+        ++level;
+      for (; level > 0; --level)
+      {
+        std::vector<entry> tmp;
+        tmp.swap(m_slots[level][(m_now >> (slot_bits * level)) & slot_mask]);
+        for (auto& i : tmp)
+          place(i.item, i.deadline);
+      }
+      std::vector<entry> due;
+      due.swap(m_slots[0][m_now & slot_mask]);
+      m_stored -= due.size();
+      for (auto& i : due)
+        if (f(i.item, i.deadline) && m_count)
+          --m_count;
+    }
+    if (!m_count && m_stored)
+      clear();
+    if (m_now < now)
+      m_now = now;
   };
 
-  mapped<T>& operator=(const T& rhs)
+private:
+  static const int levels = 4;
+  static const int slot_bits = 6;
+  static const uint64_t slot_mask = (1 << slot_bits) - 1;
+
+  struct entry
   {
-    DEBUG_THIS;
-    T::operator=(rhs);
-    return *this;
+    T item;
+    uint64_t deadline;
   };
 
-  mapped<T>& operator=(const mapped<T>& rhs)
+  void place(const T& item, uint64_t deadline)
   {
-    DEBUG_THIS;
-    ASSERT(!_reference_count);
-    _reference_count = rhs._reference_count;
-    _erase_when_unused = rhs._erase_when_unused;
-    T::operator=(rhs);
-    return *this;
+    const uint64_t delta = (deadline > m_now) ? deadline - m_now : 0;	// A stale one may be overdue
+    int level = 0;
+    while ((level + 1 < levels) && (delta >> (slot_bits * (level + 1))))
+      ++level;
+    m_slots[level][(deadline >> (slot_bits * level)) & slot_mask].push_back(entry{item, deadline});
   };
 
-  std::atomic<int> _reference_count;
-  bool _erase_when_unused = false;
+  // The first tick after now at which advance() finds a non-empty slot, at
+  // whatever level.  A slot on level n is only visited on a multiple of
+  // 64^n, so each level has at most 64 candidates.
+  uint64_t next_visit() const
+  {
+    uint64_t ret = ~uint64_t(0);
+    for (int level = 0; level < levels; ++level)
+    {
+      const int shift = slot_bits * level;
+      for (uint64_t i = (m_now >> shift) + 1; i <= (m_now >> shift) + slot_mask + 1; ++i)
+        if (!m_slots[level][i & slot_mask].empty())
+        {
+          ret = std::min(ret, i << shift);
+          break;
+        }
+    }
+    return ret;
+  };
+
+  void clear()
+  {
+    for (auto& level : m_slots)
+      for (auto& slot : level)
+        slot.clear();
+    m_stored = 0;
+  };
+
+  uint64_t m_now;
+  size_t m_count;	// Live timers
+  size_t m_stored;	// Including stale ones
+  std::vector<entry> m_slots[levels][slot_mask + 1];
 };
 
-enum DestructorSafetyType
+// Count-min sketch of how often keys turn up, for TinyLFU admission: four rows
+// of saturating 4-bit counts (kept a byte apiece), all halved once enough
+// have been added, so that popularity fades.  The counters are atomics, so
+// recording needs no lock.
+template <class key_type>
+class frequency_sketch
 {
-  NoDestructorChecks = 0,
-  SharedPointer = 1,
+public:
+  frequency_sketch(size_t width, std::function<size_t(const key_type&)> hash) :
+    m_hash(hash),
+    m_mask(round_up(width) - 1),
+    m_counters(rows * (m_mask + 1)),
+    m_additions(0),
+    m_sample_size(10 * (m_mask + 1))
+    {};
+
+  void record(const key_type& k)
+  {
+    const size_t h = m_hash(k);
+    bool added = false;
+    for (int row = 0; row < rows; ++row)
+    {
+      auto& counter = m_counters[index(h, row)];
+      uint8_t count = counter.load(std::memory_order_relaxed);
+      while ((count < max_count) && !counter.compare_exchange_weak(count, count + 1, std::memory_order_relaxed))
+        ;
+      added |= (count < max_count);
+    }
+    if (added && (m_additions.fetch_add(1, std::memory_order_relaxed) + 1 == m_sample_size))
+      age();
+  };
+
+  unsigned estimate(const key_type& k) const
+  {
+    const size_t h = m_hash(k);
+    unsigned ret = max_count;
+    for (int row = 0; row < rows; ++row)
+      ret = std::min<unsigned>(ret, m_counters[index(h, row)].load(std::memory_order_relaxed));
+    return ret;
+  };
+
+private:
+  static const int rows = 4;
+  static const uint8_t max_count = 15;
+
+  static size_t round_up(size_t n)
+  {
+    size_t ret = 64;
+    while (ret < n)
+      ret <<= 1;
+    return ret;
+  };
+
+  size_t index(size_t h, int row) const
+  {
+    static const uint64_t seeds[rows] = { 0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0xD6E8FEB86659FD93ull };
+    uint64_t x = (uint64_t(h) + seeds[row]) * seeds[(row + 1) % rows];
+    x ^= x >> 32;
+    return row * (m_mask + 1) + (x & m_mask);
+  };
+
+  void age()	// Racing recorders may lose a count or two here, which is fine for an estimate
+  {
+    for (auto& i : m_counters)
+      i.store(i.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+    m_additions.fetch_sub(m_sample_size / 2, std::memory_order_relaxed);
+  };
+
+  std::function<size_t(const key_type&)> m_hash;
+  const size_t m_mask;
+  std::vector<std::atomic<uint8_t>> m_counters;
+  std::atomic<size_t> m_additions;
+  const size_t m_sample_size;
 };
 
-enum IterationType
+// std::atomic<T> that can be copied (non-atomically), so a class can hold one
+// without losing its implicit copy constructor.
+template <class T>
+class copyable_atomic : public std::atomic<T>
 {
-  OnlyForward = 0,
-  ForwardThenBackward = 1,
-  ForwardSameThenBackward = 2,
-  EvenErased = 3
+public:
+  copyable_atomic(T v = T()) : std::atomic<T>(v) {};
+  copyable_atomic(const copyable_atomic& rhs) : std::atomic<T>(rhs.load()) {};
+  copyable_atomic& operator=(const copyable_atomic& rhs) { this->store(rhs.load()); return *this; };
+  using std::atomic<T>::operator=;
 };
 
-template <class key_type, class mapped_type,
-          bool circular = false,
-          IterationType iteration = OnlyForward,
-          DestructorSafetyType destructor = SharedPointer,
-          typename Compare = std::less<key_type>,
-          typename Allocator = typename std::conditional<std::is_class<mapped_type>{}, 
-                                                         std::allocator<std::pair<const key_type, mapped<mapped_type>>>,
-                                                         std::allocator<std::pair<const key_type, mapped<number::weak<mapped_type>>>>
-                                                        >::type >
-class map 
+// Blocked Bloom filter: each key sets a handful of bits, all within one 512
+// bit block, so a lookup touches a single cache line.  The words are atomics,
+// so it can be read with no lock while it's written (under the map's lock).
+// A "no" is definite; a "yes" is right about 99% of the time at the size it
+// was built for.
+template <class key_type>
+class bloom_filter
 {
 public:
+  bloom_filter(size_t expected, std::function<size_t(const key_type&)> hash) :
+    m_hash(hash),
+    m_block_mask(round_up(expected * bits_per_key / block_bits) - 1),
+    m_words((m_block_mask + 1) * block_words)
+    {};
 
-  typedef typename std::conditional<std::is_class<mapped_type>::value, 
-                                    mapped<mapped_type>,
-                                    mapped<number::weak<mapped_type>>
-                                    >::type safe_mapped_type;
+  size_t capacity() const { return (m_block_mask + 1) * block_bits / bits_per_key; };
+  const std::function<size_t(const key_type&)>& hash_function() const { return m_hash; };
 
-  typedef std::map<key_type, safe_mapped_type> basetype;
+  void add(const key_type& k)
+  {
+    uint64_t h = mix(m_hash(k));
+    const size_t block = block_of(h);
+    for (int i = 0; i < hashes; ++i, h >>= 9)
+      m_words[block * block_words + ((h >> 6) & 7)].fetch_or(uint64_t(1) << (h & 63), std::memory_order_release);
+  };
 
-#ifdef DEBUG
-  typedef WrappedMutex					mutex_type;
-  typedef WrappedGuard					guard_type;
-#else
-  typedef std::mutex					mutex_type;
-  typedef std::lock_guard<mutex_type>			guard_type;
-#endif
+  bool might_contain(const key_type& k) const
+  {
+    uint64_t h = mix(m_hash(k));
+    const size_t block = block_of(h);
+    for (int i = 0; i < hashes; ++i, h >>= 9)
+      if (!(m_words[block * block_words + ((h >> 6) & 7)].load(std::memory_order_acquire) & (uint64_t(1) << (h & 63))))
+        return false;
+    return true;
+  };
 
-  #define GUARD			guard_type g1(const_cast<mutex_type&>(*m_lock));
-  #define GUARD_RHS(x)		guard_type g2(const_cast<mutex_type&>(*x.m_lock));
-//  #define GUARD_COUNT		guard_type g3(const_cast<mutex_type&>(*m_lock));	// Switch to these if you experience problems
-  #define GUARD_COUNT
-//  #define GUARD_SIZE		guard_type g4(const_cast<mutex_type&>(*m_lock));
-  #define GUARD_SIZE
+  // Replaces the contents with just the keys in [first, last).  Each word only
+  // ever loses bits, so a reader part way through still can't get a false "no".
+  template <class InputIterator> void rebuild(InputIterator first, InputIterator last)
+  {
+    std::vector<uint64_t> fresh(m_words.size());
+    for (; first != last; ++first)
+      if (!first->second._erase_when_unused)
+      {
+        uint64_t h = mix(m_hash(first->first));
+        const size_t block = block_of(h);
+        for (int i = 0; i < hashes; ++i, h >>= 9)
+          fresh[block * block_words + ((h >> 6) & 7)] |= uint64_t(1) << (h & 63);
+      }
+    for (size_t i = 0; i < fresh.size(); ++i)
+      m_words[i].store(fresh[i], std::memory_order_release);
+  };
 
-  typedef typename basetype::size_type			size_type;
-  typedef std::pair<key_type, mapped_type>		value_type;
-  typedef typename basetype::value_type			safe_value_type;
-  typedef typename basetype::iterator			base_iterator;
-  typedef typename basetype::const_iterator		base_const_iterator;
-  typedef typename basetype::iterator			base_reverse_iterator;
-  typedef typename basetype::const_iterator		base_const_reverse_iterator;
-  typedef typename basetype::key_compare		key_compare;
-  typedef typename basetype::value_compare		value_compare;
+private:
+  static const int hashes = 6;
+  static const size_t bits_per_key = 10;
+  static const size_t block_bits = 512;
+  static const size_t block_words = block_bits / 64;
 
-  typedef typename std::conditional<destructor == SharedPointer, 
-                                    std::shared_ptr<std::map<key_type, safe_mapped_type, Compare, Allocator>>,
-                                    std::unique_ptr<std::map<key_type, safe_mapped_type, Compare, Allocator>>>::type map_pointer_type;
-  typedef typename std::conditional<destructor == SharedPointer, std::shared_ptr<mutex_type>, std::unique_ptr<mutex_type>>::type lock_pointer_type;
-  typedef typename std::conditional<destructor == SharedPointer, 
-                                    map_pointer_type,
-                                    std::map<key_type, safe_mapped_type, Compare, Allocator>*>::type iter_map_pointer_type;
-  typedef typename std::conditional<destructor == SharedPointer, lock_pointer_type, mutex_type*>::type iter_lock_pointer_type;
-  
-  template <class T> struct Dummy {};
-  template <bool B> struct DummyB {};
+  static size_t round_up(size_t n)
+  {
+    size_t ret = 1;
+    while (ret < n)
+      ret <<= 1;
+    return ret;
+  };
 
-  // Note: in this class we only perform assert tests on the map, not the lock. Why? Because
-  // the lock always gets transfered along with the map, so there's no point to two tests.
-  template <class T, bool Reversed>
-  class iterator_base : public T
+  size_t block_of(uint64_t h) const { return mix(h) & m_block_mask; };	// The bit positions come from h itself
+
+  static uint64_t mix(uint64_t x)	// std::hash is often the identity
   {
-  public:
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDull;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ull;
+    return x ^ (x >> 33);
+  };
 
-    iterator_base() = delete;
+  std::function<size_t(const key_type&)> m_hash;
+  const size_t m_block_mask;
+  std::vector<std::atomic<uint64_t>> m_words;
+};
 
-    iterator_base(const map_pointer_type& _map, const lock_pointer_type& _lock) : 
-      T(_map->end()),
-      m_map(convert_map_pointer_type(_map)),
-      m_lock(convert_lock_pointer_type(_lock))
+// fsync()s a file, or a directory (for the entries in it).
+inline bool sync_path(const std::string& path, const bool directory = false)
+{
+  const int fd = open(path.c_str(), directory ? (O_RDONLY | O_DIRECTORY) : O_RDONLY);
+  if (fd < 0)
+    return false;
+  const bool synced = !fsync(fd);
+  close(fd);
+  return synced;
+}
+
+inline std::string parent_directory(const std::string& path)
+{
+  const size_t slash = path.rfind('/');
+  return (slash == std::string::npos) ? "." : (slash ? path.substr(0, slash) : "/");
+}
+
+// Moves a finished file into place for good: its data's synced first, then
+// the rename, then the directory, so after a crash the target holds either
+// the old file or the whole new one.
+inline bool durable_rename(const std::string& from, const std::string& to)
+{
+  return sync_path(from) && !rename(from.c_str(), to.c_str()) && sync_path(parent_directory(to), true);
+}
+
+// The append-only log behind map::enable_journal().  append() only copies
+// the record into memory; a flusher thread writes out whatever has built
+// up and syncs it, so everyone who appended meanwhile shares one fsync
+// (group commit).  sync() waits for everything appended before it.
+class journal
+{
+public:
+  journal(const int fd, const std::string& path) :
+    m_path(path),
+    m_fd(fd),
+    m_retired_fd(-1),
+    m_appended(0),
+    m_durable(0),
+    m_failed(false),
+    m_stop(false),
+    m_sync_directory(true),	// The file may be new
+    m_flusher(&journal::flush_loop, this)
+    {};
+
+  ~journal()
+  {
     {
-      DEBUG_FIRST_SIMPLE;
-    };
-    iterator_base(T&& _iter, const map_pointer_type& _map, const lock_pointer_type& _lock) :
-      T(std::move(_iter)),
-      m_map(convert_map_pointer_type(_map)),
-      m_lock(convert_lock_pointer_type(_lock))
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_work.notify_one();
+    m_flusher.join();
+    close(m_fd);
+  };
+
+  journal(const journal&) = delete;
+  journal& operator=(const journal&) = delete;
+
+  void append(const char* p, const size_t n)
+  {
     {
-      ASSERT(m_map);
-      ASSERT(!m_lock->try_lock());	// Nýbreytt
-      DEBUG_FIRST_ITER;
-      while ((*this != map_real_end()) && ((*this)->second._erase_when_unused))
-        T::operator++();
-      reference();
-    };
-    iterator_base(iterator_base&& _iter) :
-      T(std::move(_iter)),
-      m_map(_iter.m_map),
-      m_lock(_iter.m_lock)
-    { 
-      ASSERT(m_map);
-      DEBUG_FIRST_ITER;
-      _iter.m_map = NULL; 	// Gera það ógildt
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_pending.insert(m_pending.end(), p, p + n);
+      ++m_appended;
     }
-    template<class U, bool R>
-    iterator_base(iterator_base<U, R>&& _iter) :
-      T(std::move(_iter)),
-      m_map(_iter.m_map),
-      m_lock(_iter.m_lock)
-    { 
-      ASSERT(m_map);
-      DEBUG_FIRST_ITER;
-      _iter.m_map = NULL; 	// Gera það ógildt
-    }
-    iterator_base(const T& _iter, const map_pointer_type& _map, const lock_pointer_type& _lock) :
-      T(_iter),
-      m_map(convert_map_pointer_type(_map)),
-      m_lock(convert_lock_pointer_type(_lock))
+    m_work.notify_one();
+  };
+
+  bool sync()	// False once any write or sync has failed
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    const uint64_t target = m_appended;
+    m_done.wait(lock, [&]() { return (m_durable >= target) || m_failed; });
+    return !m_failed;
+  };
+
+  // Starts a new, empty log at the same path; the old one's renamed to
+  // retired_path and finished off by the flusher.  Call with nothing else
+  // appending.  False if it couldn't, in which case nothing's changed.
+  bool rotate(const std::string& retired_path)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if ((m_retired_fd >= 0) || !access(retired_path.c_str(), F_OK) || rename(m_path.c_str(), retired_path.c_str()))
+      return false;
+    const int fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
     {
-      ASSERT(m_map);
-      ASSERT(!m_lock->try_lock());	// Nýbreytt
-      DEBUG_FIRST_ITER;
-      while ((*this != map_real_end()) && ((*this)->second._erase_when_unused))
-        T::operator++();
-      reference();
-    };
-    iterator_base(const iterator_base& _iter) :
-      T(_iter),
-      m_map(_iter.m_map),
-      m_lock(_iter.m_lock)
-    { 
-      DEBUG_FIRST_ITER;
-      ASSERT(m_map);
-      reference();
-    }
-    template<class U, bool R>
-    iterator_base(const iterator_base<U, R>& _iter) :
-      T(_iter),
-      m_map(_iter.m_map),
-      m_lock(_iter.m_lock)
-    { 
-      DEBUG_FIRST_ITER;
-      ASSERT(m_map);
-      reference();
+      rename(retired_path.c_str(), m_path.c_str());
+      return false;
     }
-    ~iterator_base()
-    { 
-      if (m_map)
-      {
-        DEBUG_FIRST_SIMPLE;
-        dereference(); 
-      }
-      else
-        DEBUG_THIS;
-    };
-    
-    iterator_base<T, Reversed>& operator--() { DEBUG_FIRST_SIMPLE; return (Reversed ? do_plus() : do_minus()); };
-    iterator_base<T, Reversed>& operator++() { DEBUG_FIRST_SIMPLE; return (Reversed ? do_minus() : do_plus()); };
-    iterator_base<T, Reversed> operator--(int x) { DEBUG_FIRST_SIMPLE; return (Reversed ? do_plus(x) : do_minus(x)); };
-    iterator_base<T, Reversed> operator++(int x) { DEBUG_FIRST_SIMPLE; return (Reversed ? do_minus(x) : do_plus(x)); };
+    m_retired_fd = m_fd;
+    m_retired.swap(m_pending);
+    m_fd = fd;
+    m_sync_directory = true;	// Synced records mustn't be in a file whose name could still be lost
+    m_work.notify_one();
+    return true;
+  };
 
-    template<class U, bool R> iterator_base<T, Reversed>& operator=(iterator_base<U, R>&& rhs)
-    {
-      DEBUG_FIRST_SIMPLE;
-      ASSERT(rhs.m_map);
-      if (m_map)
-      {
-        m_map = rhs.m_map;
-        m_lock = rhs.m_lock;
-        guard_type guard(*m_lock);
-        auto need_erase = delayed_dereference();
-        T::operator=(std::move(rhs));
-        reference();
-        if (need_erase != map_real_end())
-        {
-          if (need_erase->first != (*this)->first)
-            map_erase(need_erase);
-        }
-      }
-      else
-      {
-        m_map = rhs.m_map;
-        m_lock = rhs.m_lock;
-        T::operator=(std::move(rhs));
-        guard_type guard(*m_lock);
-        reference();
-      }
-      return *this;
-    };
-    
-    template<class U, bool R> iterator_base<T, Reversed>& operator=(const iterator_base<U, R>& rhs)
-    {
-      DEBUG_FIRST_SIMPLE;
-      ASSERT(rhs.m_map);
-      if (m_map)
-      {
-        m_map = rhs.m_map;
-        m_lock = rhs.m_lock;
-        guard_type guard(*m_lock);
-        auto need_erase = delayed_dereference();
-        T::operator=(rhs);
-        reference();
-        if (need_erase != map_real_end())
-        {
-          if (need_erase->first != (*this)->first)
-            map_erase(need_erase);
-        }
-      }
-      else
-      {
-        m_map = rhs.m_map;
-        m_lock = rhs.m_lock;
-        T::operator=(rhs);
-        guard_type guard(*m_lock);
-        reference();
-      }
-      return *this;
-    };
-    
-    template<class U, bool R> iterator_base<T, Reversed>& operator=(iterator_base<U, R>& rhs)
-    {
-      DEBUG_FIRST_SIMPLE;
-      ASSERT(rhs.m_map);
-      if (m_map)
-      {
-        m_map = rhs.m_map;
-        m_lock = rhs.m_lock;
-        guard_type guard(*m_lock);
-        auto need_erase = delayed_dereference();
-        T::operator=(rhs);
-        reference();
-        if (need_erase != map_real_end())
-        {
-          if (need_erase->first != (*this)->first)
-            map_erase(need_erase);
-        }
-      }
-      else
-      {
-        m_map = rhs.m_map;
-        m_lock = rhs.m_lock;
-        T::operator=(rhs);
-        guard_type guard(*m_lock);
-        reference();
-      }
-      return *this;
-    };
-    
-    template <class R> iterator_base<T, Reversed>& operator=(R rhs)
-    {
-      ASSERT(m_map);
-      guard_type guard(*m_lock);
-      DEBUG_FIRST;
-      auto need_erase = delayed_dereference();
-      T::operator=(rhs);
-      while ((*this != map_real_end()) && ((*this)->second._erase_when_unused))
-        T::operator++();
-      reference();
-      if (need_erase != map_real_end())
-      {
-        if (need_erase->first != (*this)->first)
-          map_erase(need_erase);
-      }
-      return *this;
-    };
+  static uint32_t checksum(const char* p, const size_t n)	// FNV-1a, to spot a record torn by a crash
+  {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; ++i)
+      h = (h ^ static_cast<unsigned char>(p[i])) * 16777619u;
+    return h;
+  };
 
-    iterator_base<T, Reversed>& do_minus()
+private:
+  static bool write_all(const int fd, const std::vector<char>& bytes)
+  {
+    for (size_t done = 0; done < bytes.size(); )
     {
-      DEBUG_FIRST_SIMPLE;
-      if (circular)
-      {
-        if (iteration != EvenErased)
-          do_increment_or_decrement(FN(decrement_active_circular_core));
-        else
-          do_increment_or_decrement(FN(decrement_even_erased_circular_core));
-      }
-      else
-      {
-        if (iteration == OnlyForward)
-          do_increment_or_decrement(FN(decrement_forward_core));
-        else if ((iteration == ForwardThenBackward) || (iteration == ForwardSameThenBackward))
-          do_increment_or_decrement(FN(decrement_forward_then_backward_core));
-        else
-          do_increment_or_decrement(FN(decrement_even_erased_linear_core));
-      }
-      return *this;
-    };
+      const ssize_t n = write(fd, bytes.data() + done, bytes.size() - done);
+      if (n < 0)
+        return false;
+      done += n;
+    }
+    return true;
+  };
 
-    iterator_base<T, Reversed>& do_plus()
-    {
-      DEBUG_FIRST_SIMPLE;
-      if (circular)
-      {
-        if (iteration != EvenErased)
-          do_increment_or_decrement(FN(increment_active_circular_core));
-        else
-          do_increment_or_decrement(FN(increment_even_erased_circular_core));
-      }
-      else
-      {
-        if (iteration == OnlyForward)
-          do_increment_or_decrement(FN(increment_forward_core));
-        else if ((iteration == ForwardThenBackward) || (iteration == ForwardSameThenBackward))
-          do_increment_or_decrement(FN(increment_forward_then_backward_core));
-        else
-          do_increment_or_decrement(FN(increment_even_erased_linear_core));
-      }
-      return *this;
-    };
+  static bool sync_fd(const int fd)
+  {
+#if defined(__linux__)
+    return !fdatasync(fd);
+#else
+    return !fsync(fd);
+#endif
+  };
 
-    iterator_base<T, Reversed> do_minus(int x)
+  void flush_loop()
+  {
+    std::vector<char> pending, retired;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;)
     {
-      DEBUG_FIRST_SIMPLE;
-      if (circular)
-      {
-        if (iteration != EvenErased)
-          return do_increment_or_decrement_return(FN(decrement_active_circular_core));
-        else
-          return do_increment_or_decrement_return(FN(decrement_even_erased_circular_core));
-      }
-      else
+      m_work.wait(lock, [&]() { return m_stop || !m_pending.empty() || (m_retired_fd >= 0); });
+      if (m_pending.empty() && (m_retired_fd < 0))
+        return;
+      pending.swap(m_pending);
+      retired.swap(m_retired);
+      const int fd = m_fd, retired_fd = m_retired_fd;
+      const bool sync_directory = m_sync_directory;
+      const uint64_t target = m_appended;
+      m_retired_fd = -1;
+      m_sync_directory = false;
+      lock.unlock();
+
+      bool ok = true;
+      if (retired_fd >= 0)
       {
-        if (iteration == OnlyForward)
-          return do_increment_or_decrement_return(FN(decrement_forward_core));
-        else if ((iteration == ForwardThenBackward) || (iteration == ForwardSameThenBackward))
-          return do_increment_or_decrement_return(FN(decrement_forward_then_backward_core));
-        else
-          return do_increment_or_decrement_return(FN(decrement_even_erased_linear_core));
+        ok = write_all(retired_fd, retired) && sync_fd(retired_fd);
+        close(retired_fd);
       }
-    };
-    
-    
+      if (!pending.empty())
+        ok = write_all(fd, pending) && sync_fd(fd) && ok;
+      if (sync_directory)
+        ok = sync_path(parent_directory(m_path), true) && ok;
+      pending.clear();
+      retired.clear();
+
+      lock.lock();
+      m_failed = m_failed || !ok;
+      m_durable = target;
+      m_done.notify_all();
+    }
+  };
 
-    iterator_base<T, Reversed> do_plus(int x)
-    {
-      DEBUG_FIRST_SIMPLE;
-      if (circular)
-      {
-        if (iteration != EvenErased)
-          return do_increment_or_decrement_return(FN(increment_active_circular_core));
-        else
-          return do_increment_or_decrement_return(FN(increment_even_erased_circular_core));
-      }
-      else
-      {
-        if (iteration == OnlyForward)
-          return do_increment_or_decrement_return(FN(increment_forward_core));
-        else if ((iteration == ForwardThenBackward) || (iteration == ForwardSameThenBackward))
-          return do_increment_or_decrement_return(FN(increment_forward_then_backward_core));
-        else
-          return do_increment_or_decrement_return(FN(increment_even_erased_linear_core));
-      }
-    };
-    
-    iterator_base<T, Reversed>& decrement_active_circular()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(decrement_active_circular_core)); return *this; };
-    
-    iterator_base<T, Reversed>& increment_active_circular()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(decrement_active_circular_core)); return *this; };
+  const std::string m_path;
+  std::mutex m_mutex;
+  std::condition_variable m_work;
+  std::condition_variable m_done;
+  std::vector<char> m_pending;
+  std::vector<char> m_retired;
+  int m_fd;
+  int m_retired_fd;
+  uint64_t m_appended;	// Records, not bytes
+  uint64_t m_durable;
+  bool m_failed;
+  bool m_stop;
+  bool m_sync_directory;
+  std::thread m_flusher;	// Last, so it starts with everything else ready
+};
 
-    iterator_base<T, Reversed>& decrement_forward()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(decrement_forward_core)); return *this; };
+// Buffered binary output for map::serialize(): values are appended to one
+// growing buffer, which goes to the stream in a single write per flush().
+// Without a stream it just builds up bytes, for data() to pass on.
+class serial_writer
+{
+public:
+  serial_writer() :
+    m_out(nullptr)
+    {};
+  explicit serial_writer(std::ostream& out) :
+    m_out(&out)
+    {};
+
+  void put(const void* p, size_t n)
+  {
+    const char* c = static_cast<const char*>(p);
+    m_buffer.insert(m_buffer.end(), c, c + n);
+  };
 
-    iterator_base<T, Reversed>& increment_forward()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(increment_forward_core)); return *this; };
-    
-    iterator_base<T, Reversed>& decrement_forward_then_backward()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(increment_forward_then_backward_core)); return *this; };
+  void put_u32(uint32_t v)	// Big-endian, like everything else
+  {
+    const char b[4] = { char(v >> 24), char(v >> 16), char(v >> 8), char(v) };
+    put(b, 4);
+  };
 
-    iterator_base<T, Reversed>& increment_forward_then_backward()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(increment_forward_then_backward_core)); return *this; };
+  void rewind(size_t position) { m_buffer.resize(position); };
 
-    iterator_base<T, Reversed>& decrement_even_erased_linear()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(decrement_even_erased_linear_core)); return *this; };
+  void put_varint(uint64_t v)
+  {
+    char b[number::varint_max_size];
+    put(b, number::varint_encode(v, b));
+  };
 
-    iterator_base<T, Reversed>& increment_even_erased_linear()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(increment_even_erased_linear_core)); return *this; };
+  size_t size() const { return m_buffer.size(); };
+  const char* data() const { return m_buffer.data(); };
+  void clear() { m_buffer.clear(); };
 
-    iterator_base<T, Reversed>& decrement_even_erased_circular()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(decrement_even_erased_circular_core)); return *this; };
+  void patch_u32(size_t position, uint32_t v)
+  {
+    m_buffer[position] = char(v >> 24);
+    m_buffer[position + 1] = char(v >> 16);
+    m_buffer[position + 2] = char(v >> 8);
+    m_buffer[position + 3] = char(v);
+  };
 
-    iterator_base<T, Reversed>& increment_even_erased_circular()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(increment_even_erased_circular_core)); return *this; };
+  bool flush()
+  {
+    m_out->write(m_buffer.data(), m_buffer.size());
+    m_buffer.clear();
+    return bool(*m_out);
+  };
 
-    iterator_base<T, Reversed>& decrement_active_circular(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(decrement_active_circular_core), m_map, m_lock); };
-    
-    iterator_base<T, Reversed>& increment_active_circular(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(decrement_active_circular_core), m_map, m_lock); };
+private:
+  std::ostream* m_out;
+  std::vector<char> m_buffer;
+};
 
-    iterator_base<T, Reversed>& decrement_forward(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(decrement_forward_core), m_map, m_lock); };
+// The matching input side, reading the stream a large block at a time - or
+// reading straight out of bytes already in memory.
+class serial_reader
+{
+public:
+  explicit serial_reader(std::istream& in) :
+    m_in(&in),
+    m_buffer(buffer_size),
+    m_data(m_buffer.data()),
+    m_position(0),
+    m_end(0)
+    {};
+  serial_reader(const char* data, const size_t size) :
+    m_in(nullptr),
+    m_data(data),
+    m_position(0),
+    m_end(size)
+    {};
+
+  bool get(void* p, size_t n)
+  {
+    char* c = static_cast<char*>(p);
+    while (n)
+    {
+      if ((m_position == m_end) && !refill())
+        return false;
+      const size_t chunk = std::min(n, m_end - m_position);
+      memcpy(c, m_data + m_position, chunk);
+      m_position += chunk;
+      c += chunk;
+      n -= chunk;
+    }
+    return true;
+  };
 
-    iterator_base<T, Reversed>& increment_forward(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(increment_forward_core), m_map, m_lock); };
-    
-    iterator_base<T, Reversed>& decrement_forward_then_backward(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(increment_forward_then_backward_core), m_map, m_lock); };
+  bool get_u32(uint32_t& v)
+  {
+    unsigned char b[4];
+    if (!get(b, 4))
+      return false;
+    v = (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) | (uint32_t(b[2]) << 8) | b[3];
+    return true;
+  };
 
-    iterator_base<T, Reversed>& increment_forward_then_backward(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(increment_forward_then_backward_core), m_map, m_lock); };
+  bool get_varint(uint64_t& v)
+  {
+    if (m_end - m_position >= size_t(number::varint_max_size))	// Straight from the buffer
+    {
+      const int n = number::varint_decode(m_data + m_position, m_end - m_position, v);
+      m_position += n;
+      return n;
+    }
+    char b[number::varint_max_size];	// Near the end of the buffer, a byte at a time
+    for (int n = 0; n < number::varint_max_size; )
+    {
+      if (!get(&b[n], 1))
+        return false;
+      if (!(b[n++] & 0x80))
+        return number::varint_decode(b, n, v);
+    }
+    return false;
+  };
 
-    iterator_base<T, Reversed>& decrement_even_erased_linear(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(decrement_even_erased_linear_core), m_map, m_lock); };
+private:
+  static const size_t buffer_size = 1 << 16;
 
-    iterator_base<T, Reversed>& increment_even_erased_linear(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(increment_even_erased_linear_core), m_map, m_lock); };
+  bool refill()
+  {
+    if (!m_in)
+      return false;
+    m_in->read(&m_buffer[0], m_buffer.size());
+    m_position = 0;
+    m_end = m_in->gcount();
+    return m_end;
+  };
 
-    iterator_base<T, Reversed>& decrement_even_erased_circular(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(decrement_even_erased_circular_core), m_map, m_lock); };
+  std::istream* m_in;
+  std::vector<char> m_buffer;
+  const char* m_data;
+  size_t m_position;
+  size_t m_end;
+};
 
-    iterator_base<T, Reversed>& increment_even_erased_circular(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(increment_even_erased_circular_core), m_map, m_lock); };
+// How keys and values are written by map::serialize(): arithmetic types as
+// big-endian bytes (as number::base::serialize() does), strings as a length
+// and their bytes, number types as the number inside, other types with a
+// serialize()/deserialize() pair as a length and whatever serialize() gives,
+// and anything else trivially copyable as its raw bytes.
+template <class T>
+struct is_number_type
+{
+  template <class U> static std::true_type test(const number::base<U>*);
+  static std::false_type test(...);
+  static const bool value = decltype(test(static_cast<const T*>(nullptr)))::value;
+};
 
-    iterator_base<T, Reversed>& decrement_active_circular_prelocked()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(decrement_active_circular_core)); return *this; };
-    
-    iterator_base<T, Reversed>& increment_active_circular_prelocked()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(decrement_active_circular_core)); return *this; };
+template <class T>
+struct has_serialize
+{
+  template <class U> static auto test(const U* u) -> decltype(u->serialize(), std::true_type());
+  static std::false_type test(...);
+  static const bool value = decltype(test(static_cast<const T*>(nullptr)))::value;
+};
 
-    iterator_base<T, Reversed>& decrement_forward_prelocked()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(decrement_forward_core)); return *this; };
+template <class T, class Enable = void> struct serial_codec;
 
-    iterator_base<T, Reversed>& increment_forward_prelocked()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(increment_forward_core)); return *this; };
-    
-    iterator_base<T, Reversed>& decrement_forward_then_backward_prelocked()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(increment_forward_then_backward_core)); return *this; };
+template <class T>
+struct is_serializable : std::integral_constant<bool, std::is_arithmetic<T>::value || std::is_same<T, std::string>::value ||
+  is_number_type<T>::value || has_serialize<T>::value || std::is_trivially_copyable<T>::value> {};
 
-    iterator_base<T, Reversed>& increment_forward_then_backward_prelocked()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(increment_forward_then_backward_core)); return *this; };
+template <class T>
+struct serial_codec<T, typename std::enable_if<std::is_arithmetic<T>::value>::type>
+{
+  static void write(serial_writer& w, const T& v)
+  {
+    char b[sizeof(T)];
+    number::base<T>(v).serialize_into(b);
+    w.put(b, sizeof(T));
+  };
+  static bool read(serial_reader& r, T& v)
+  {
+    char b[sizeof(T)];
+    if (!r.get(b, sizeof(T)))
+      return false;
+    number::base<T> tmp;
+    tmp.deserialize_from(b);
+    v = tmp.var;
+    return true;
+  };
+};
 
-    iterator_base<T, Reversed>& decrement_even_erased_linear_prelocked()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(decrement_even_erased_linear_core)); return *this; };
+template <>
+struct serial_codec<std::string>
+{
+  static void write(serial_writer& w, const std::string& v)
+  {
+    if (v.size() > 0xffffffffu)	// The length has to fit its 32 bits
+      throw std::length_error("serial_codec<std::string>::write");
+    w.put_u32(v.size());
+    w.put(v.data(), v.size());
+  };
+  // The length comes from the input, so the string only grows as the bytes
+  // turn up - a bad one runs out of input rather than memory.
+  static bool read(serial_reader& r, std::string& v)
+  {
+    uint32_t n;
+    if (!r.get_u32(n))
+      return false;
+    v.clear();
+    while (n)
+    {
+      const uint32_t chunk = std::min<uint32_t>(n, 1 << 16);
+      const size_t at = v.size();
+      v.resize(at + chunk);
+      if (!r.get(&v[at], chunk))
+        return false;
+      n -= chunk;
+    }
+    return true;
+  };
+};
 
-    iterator_base<T, Reversed>& increment_even_erased_linear_prelocked()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(increment_even_erased_linear_core)); return *this; };
+template <class T>
+struct serial_codec<T, typename std::enable_if<is_number_type<T>::value>::type>
+{
+  typedef decltype(std::declval<T>().var) value_type;
+  static void write(serial_writer& w, const T& v) { serial_codec<value_type>::write(w, v.var); };
+  static bool read(serial_reader& r, T& v) { return serial_codec<value_type>::read(r, v.var); };
+};
 
-    iterator_base<T, Reversed>& decrement_even_erased_circular_prelocked()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(decrement_even_erased_circular_core)); return *this; };
+template <class T>
+struct serial_codec<T, typename std::enable_if<has_serialize<T>::value && !is_number_type<T>::value && !std::is_same<T, std::string>::value>::type>
+{
+  static void write(serial_writer& w, const T& v) { serial_codec<std::string>::write(w, v.serialize()); };
+  static bool read(serial_reader& r, T& v)
+  {
+    std::string tmp;
+    if (!serial_codec<std::string>::read(r, tmp))
+      return false;
+    v.deserialize(tmp);
+    return true;
+  };
+};
 
-    iterator_base<T, Reversed>& increment_even_erased_circular_prelocked()
-      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(increment_even_erased_circular_core)); return *this; };
+template <class T>
+struct serial_codec<T, typename std::enable_if<std::is_trivially_copyable<T>::value && !std::is_arithmetic<T>::value && !has_serialize<T>::value && !is_number_type<T>::value>::type>
+{
+  static void write(serial_writer& w, const T& v) { w.put(&v, sizeof(T)); };
+  static bool read(serial_reader& r, T& v) { return r.get(&v, sizeof(T)); };
+};
 
-    iterator_base<T, Reversed>& decrement_active_circular_prelocked(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(decrement_active_circular_core), m_map, m_lock); };
-    
-    iterator_base<T, Reversed>& increment_active_circular_prelocked(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(decrement_active_circular_core), m_map, m_lock); };
+// The compact format writes integers, and number types holding them, as
+// varints instead (zigzagged if signed).  Keys go in as the difference
+// from the key before them in the block, so a run of nearby keys takes a
+// byte or so each.  Everything else is written as serial_codec writes it.
+template <class T, class Enable = void>
+struct compact_integer
+{
+  static const bool value = false;
+};
 
-    iterator_base<T, Reversed>& decrement_forward_prelocked(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(decrement_forward_core), m_map, m_lock); };
+template <class T>
+struct compact_integer<T, typename std::enable_if<std::is_integral<T>::value>::type>
+{
+  static const bool value = true;
+  typedef T type;
+  static T& get(T& v) { return v; };
+  static const T& get(const T& v) { return v; };
+};
 
-    iterator_base<T, Reversed>& increment_forward_prelocked(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(increment_forward_core), m_map, m_lock); };
-    
-    iterator_base<T, Reversed>& decrement_forward_then_backward_prelocked(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(increment_forward_then_backward_core), m_map, m_lock); };
+template <class T>
+struct compact_integer<T, typename std::enable_if<is_number_type<T>::value && std::is_integral<decltype(std::declval<T>().var)>::value>::type>
+{
+  static const bool value = true;
+  typedef decltype(std::declval<T>().var) type;
+  static type& get(T& v) { return v.var; };
+  static const type& get(const T& v) { return v.var; };
+};
 
-    iterator_base<T, Reversed>& increment_forward_then_backward_prelocked(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(increment_forward_then_backward_core), m_map, m_lock); };
+template <class T, class Enable = void>
+struct compact_codec
+{
+  static void write(serial_writer& w, const T& v, const T* = nullptr) { serial_codec<T>::write(w, v); };
+  static bool read(serial_reader& r, T& v, const T* = nullptr) { return serial_codec<T>::read(r, v); };
+};
 
-    iterator_base<T, Reversed>& decrement_even_erased_linear_prelocked(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(decrement_even_erased_linear_core), m_map, m_lock); };
+template <class T>
+struct compact_codec<T, typename std::enable_if<compact_integer<T>::value>::type>
+{
+  typedef compact_integer<T> integer;
+  typedef typename integer::type integer_type;
 
-    iterator_base<T, Reversed>& increment_even_erased_linear_prelocked(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(increment_even_erased_linear_core), m_map, m_lock); };
+  static void write(serial_writer& w, const T& v, const T* previous = nullptr)
+  {
+    if (previous)	// Wraps around for differences too big to hold, and back again on the way in
+      w.put_varint(number::zigzag_encode(int64_t(uint64_t(integer::get(v)) - uint64_t(integer::get(*previous)))));
+    else
+      w.put_varint(number::compact_encode(integer::get(v)));
+  };
 
-    iterator_base<T, Reversed>& decrement_even_erased_circular_prelocked(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(decrement_even_erased_circular_core), m_map, m_lock); };
+  static bool read(serial_reader& r, T& v, const T* previous = nullptr)
+  {
+    uint64_t u;
+    if (!r.get_varint(u))
+      return false;
+    if (!previous)
+      return number::compact_decode(u, integer::get(v));
+    integer::get(v) = integer_type(uint64_t(integer::get(*previous)) + uint64_t(number::zigzag_decode(u)));
+    return true;
+  };
+};
 
-    iterator_base<T, Reversed>& increment_even_erased_circular_prelocked(int)
-      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(increment_even_erased_circular_core), m_map, m_lock); };
+template <class T>
+class mapped : public T	// Helper class for map - adds in the reference counter and erasure flag
+{
+public:
 
-    iter_map_pointer_type m_map;
-    iter_lock_pointer_type m_lock;
+  template <class U>
+  mapped(U rhs) :
+    T(rhs),
+    _reference_count(0),
+    _erase_when_unused(false)
+    {
+      DEBUG_THIS;
+    }
 
-  protected:
+  mapped() :
+    _reference_count(0),
+    _erase_when_unused(false)
+    {
+      DEBUG_THIS;
+    };
 
-    iter_map_pointer_type convert_map_pointer_type(const map_pointer_type& rhs) const
-      { return convert_pointer_type<iter_map_pointer_type, map_pointer_type>(rhs); };
-    iter_lock_pointer_type convert_lock_pointer_type(const lock_pointer_type& rhs) const
-      { return convert_pointer_type<iter_lock_pointer_type, lock_pointer_type>(rhs); };
+  mapped(mapped<T>&& rhs) :	// Don't steal reference counts - each object has to be unique, even if copied.
+    T(std::move(rhs)),
+    _reference_count(0),
+    _erase_when_unused(false)
+    {
+      DEBUG_THIS;
+    };
+
+  mapped(T&& rhs) : 
+    T(std::move(rhs)),
+    _reference_count(0),
+    _erase_when_unused(false)
+    {
+      DEBUG_THIS;
+    };
+ 
+  mapped(const T& rhs) : 
+    T(rhs),
+    _reference_count(0),
+    _erase_when_unused(false)
+    {
+      DEBUG_THIS;
+    };
+  
+  mapped(const mapped<T>& rhs) : 
+    T(rhs),
+    _reference_count(0),
+    _erase_when_unused(false)
+    {
+      DEBUG_THIS;
+    };
+  
+  template <class U>
+  mapped<T>& operator=(U rhs)
+  {
+    DEBUG_THIS;
+    T::operator=(rhs);
+    return *this;
+  };
+
+  mapped<T>& operator=(T&& rhs)
+  {
+    DEBUG_THIS;
+    T::operator=(std::move(rhs));
+    return *this;
+  };
+
+  mapped<T>& operator=(mapped<T>&& rhs)
+  {
+    DEBUG_THIS;
+    ASSERT(!_reference_count);
+    _reference_count = rhs._reference_count;
+    _erase_when_unused = rhs._erase_when_unused;
+    T::operator=(std::move(rhs));
+    return *this;
+  };
+
+  mapped<T>& operator=(const T& rhs)
+  {
+    DEBUG_THIS;
+    T::operator=(rhs);
+    return *this;
+  };
+
+  mapped<T>& operator=(const mapped<T>& rhs)
+  {
+    DEBUG_THIS;
+    ASSERT(!_reference_count);
+    _reference_count = rhs._reference_count;
+    _erase_when_unused = rhs._erase_when_unused;
+    T::operator=(rhs);
+    return *this;
+  };
+
+  std::atomic<int> _reference_count;
+  bool _erase_when_unused = false;
+  bool _accessed = false;	// CLOCK reference bit, for maps with a capacity
+  bool _unlinked = false;	// Taken out of the tree while pinned (see map::unlink_prelocked)
+};
+
+template <class T>
+class seqlocked	// Value wrapper for consistent lock-free reads - readers retry if a write overlapped them
+{
+  static_assert(std::is_trivially_copyable<T>::value, "seqlocked values have to be trivially copyable");
+
+public:
+
+  seqlocked() : m_sequence(0) { write_words(T()); };
+  seqlocked(const T& rhs) : m_sequence(0) { write_words(rhs); };
+  seqlocked(const seqlocked<T>& rhs) : m_sequence(0) { write_words(rhs.load()); };
+
+  seqlocked<T>& operator=(const T& rhs) { store(rhs); return *this; };
+  seqlocked<T>& operator=(const seqlocked<T>& rhs) { store(rhs.load()); return *this; };
+  operator T() const { return load(); };
+
+  T load() const
+  {
+    word_type buf[words];
+    while (true)
+    {
+      const unsigned int before = m_sequence.load(std::memory_order_acquire);
+      if (!(before & 1))
+      {
+        for (size_t i = 0; i < words; ++i)
+          buf[i] = m_words[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_sequence.load(std::memory_order_relaxed) == before)
+          break;
+      }
+      std::this_thread::yield();
+    }
+    T ret;
+    memcpy(&ret, buf, sizeof(T));
+    return ret;
+  };
+
+  void store(const T& rhs)
+  {
+    begin_write();
+    write_words(rhs);
+    end_write();
+  };
+
+  // Read-modify-write; f gets a T& to change.  Other writers wait, readers retry.
+  template <class F> void update(F f)
+  {
+    begin_write();
+    T tmp = load_unlocked();
+    f(tmp);
+    write_words(tmp);
+    end_write();
+  };
+
+protected:
+
+  typedef uintptr_t word_type;
+  static const size_t words = (sizeof(T) + sizeof(word_type) - 1) / sizeof(word_type);
+
+  void begin_write()
+  {
+    unsigned int sequence = m_sequence.load(std::memory_order_relaxed);
+    while ((sequence & 1) || !m_sequence.compare_exchange_weak(sequence, sequence + 1, std::memory_order_acquire))
+    {
+      std::this_thread::yield();
+      sequence = m_sequence.load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+  };
+
+  void end_write() { m_sequence.fetch_add(1, std::memory_order_release); };
+
+  T load_unlocked() const
+  {
+    word_type buf[words];
+    for (size_t i = 0; i < words; ++i)
+      buf[i] = m_words[i].load(std::memory_order_relaxed);
+    T ret;
+    memcpy(&ret, buf, sizeof(T));
+    return ret;
+  };
+
+  void write_words(const T& rhs)
+  {
+    word_type buf[words] = {};
+    memcpy(buf, &rhs, sizeof(T));
+    for (size_t i = 0; i < words; ++i)
+      m_words[i].store(buf[i], std::memory_order_relaxed);
+  };
+
+  std::atomic<unsigned int> m_sequence;	// Odd while a write is in progress
+  std::atomic<word_type> m_words[words];	// The value, copied in and out a word at a time
+};
+
+template <class key_type, class mapped_type, typename Compare> class frozen_map;
+
+enum DestructorSafetyType
+{
+  NoDestructorChecks = 0,
+  SharedPointer = 1,
+};
+
+enum IterationType
+{
+  OnlyForward = 0,
+  ForwardThenBackward = 1,
+  ForwardSameThenBackward = 2,
+  EvenErased = 3
+};
+
+template <class key_type, class mapped_type,
+          bool circular = false,
+          IterationType iteration = OnlyForward,
+          DestructorSafetyType destructor = SharedPointer,
+          typename Compare = std::less<key_type>,
+          typename Allocator = typename std::conditional<std::is_class<mapped_type>{}, 
+                                                         std::allocator<std::pair<const key_type, mapped<mapped_type>>>,
+                                                         std::allocator<std::pair<const key_type, mapped<number::weak<mapped_type>>>>
+                                                        >::type >
+class map 
+{
+public:
+
+  typedef typename std::conditional<std::is_class<mapped_type>::value, 
+                                    mapped<mapped_type>,
+                                    mapped<number::weak<mapped_type>>
+                                    >::type safe_mapped_type;
+
+  typedef std::map<key_type, safe_mapped_type> basetype;
+
+#ifdef DEBUG
+  typedef WrappedMutex					mutex_type;
+  typedef WrappedGuard					guard_type;
+#else
+  typedef std::mutex					mutex_type;
+  typedef std::lock_guard<mutex_type>			guard_type;
+#endif
+
+  #define GUARD			guard_type g1(const_cast<mutex_type&>(*m_lock));
+  #define GUARD_PAIR(a, b)	multi_guard<mutex_type, 2> g1(const_cast<mutex_type&>(*(a).m_lock), const_cast<mutex_type&>(*(b).m_lock));
+//  #define GUARD_COUNT		guard_type g3(const_cast<mutex_type&>(*m_lock));	// Switch to these if you experience problems
+  #define GUARD_COUNT
+//  #define GUARD_SIZE		guard_type g4(const_cast<mutex_type&>(*m_lock));
+  #define GUARD_SIZE
+
+  typedef typename basetype::size_type			size_type;
+  typedef std::pair<key_type, mapped_type>		value_type;
+  typedef typename basetype::value_type			safe_value_type;
+  typedef typename basetype::iterator			base_iterator;
+  typedef typename basetype::const_iterator		base_const_iterator;
+  typedef typename basetype::iterator			base_reverse_iterator;
+  typedef typename basetype::const_iterator		base_const_reverse_iterator;
+  typedef typename basetype::key_compare		key_compare;
+  typedef typename basetype::value_compare		value_compare;
+
+  typedef typename std::conditional<destructor == SharedPointer, 
+                                    std::shared_ptr<std::map<key_type, safe_mapped_type, Compare, Allocator>>,
+                                    std::unique_ptr<std::map<key_type, safe_mapped_type, Compare, Allocator>>>::type map_pointer_type;
+  typedef typename std::conditional<destructor == SharedPointer, std::shared_ptr<mutex_type>, std::unique_ptr<mutex_type>>::type lock_pointer_type;
+  typedef typename std::conditional<destructor == SharedPointer, 
+                                    map_pointer_type,
+                                    std::map<key_type, safe_mapped_type, Compare, Allocator>*>::type iter_map_pointer_type;
+  typedef typename std::conditional<destructor == SharedPointer, lock_pointer_type, mutex_type*>::type iter_lock_pointer_type;
+  
+  template <class T> struct Dummy {};
+  template <bool B> struct DummyB {};
+
+  // Note: in this class we only perform assert tests on the map, not the lock. Why? Because
+  // the lock always gets transfered along with the map, so there's no point to two tests.
+  template <class T, bool Reversed>
+  class iterator_base : public T
+  {
+  public:
+
+    iterator_base() = delete;
+
+    iterator_base(const map_pointer_type& _map, const lock_pointer_type& _lock) : 
+      T(_map->end()),
+      m_map(convert_map_pointer_type(_map)),
+      m_lock(convert_lock_pointer_type(_lock))
+    {
+      DEBUG_FIRST_SIMPLE;
+    };
+    iterator_base(T&& _iter, const map_pointer_type& _map, const lock_pointer_type& _lock) :
+      T(std::move(_iter)),
+      m_map(convert_map_pointer_type(_map)),
+      m_lock(convert_lock_pointer_type(_lock))
+    {
+      ASSERT(m_map);
+      ASSERT(!m_lock->try_lock());	// Nýbreytt
+      DEBUG_FIRST_ITER;
+      while ((*this != map_real_end()) && ((*this)->second._erase_when_unused))
+        T::operator++();
+      reference();
+    };
+    iterator_base(iterator_base&& _iter) :
+      T(std::move(_iter)),
+      m_map(_iter.m_map),
+      m_lock(_iter.m_lock)
+    { 
+      ASSERT(m_map);
+      DEBUG_FIRST_ITER;
+      _iter.m_map = NULL; 	// Gera það ógildt
+    }
+    template<class U, bool R>
+    iterator_base(iterator_base<U, R>&& _iter) :
+      T(std::move(_iter)),
+      m_map(_iter.m_map),
+      m_lock(_iter.m_lock)
+    { 
+      ASSERT(m_map);
+      DEBUG_FIRST_ITER;
+      _iter.m_map = NULL; 	// Gera það ógildt
+    }
+    iterator_base(const T& _iter, const map_pointer_type& _map, const lock_pointer_type& _lock) :
+      T(_iter),
+      m_map(convert_map_pointer_type(_map)),
+      m_lock(convert_lock_pointer_type(_lock))
+    {
+      ASSERT(m_map);
+      ASSERT(!m_lock->try_lock());	// Nýbreytt
+      DEBUG_FIRST_ITER;
+      while ((*this != map_real_end()) && ((*this)->second._erase_when_unused))
+        T::operator++();
+      reference();
+    };
+    iterator_base(const iterator_base& _iter) :
+      T(_iter),
+      m_map(_iter.m_map),
+      m_lock(_iter.m_lock)
+    { 
+      DEBUG_FIRST_ITER;
+      ASSERT(m_map);
+      reference();
+    }
+    template<class U, bool R>
+    iterator_base(const iterator_base<U, R>& _iter) :
+      T(_iter),
+      m_map(_iter.m_map),
+      m_lock(_iter.m_lock)
+    { 
+      DEBUG_FIRST_ITER;
+      ASSERT(m_map);
+      reference();
+    }
+    ~iterator_base()
+    { 
+      if (m_map)
+      {
+        DEBUG_FIRST_SIMPLE;
+        dereference(); 
+      }
+      else
+        DEBUG_THIS;
+    };
+    
+    iterator_base<T, Reversed>& operator--() { DEBUG_FIRST_SIMPLE; return (Reversed ? do_plus() : do_minus()); };
+    iterator_base<T, Reversed>& operator++() { DEBUG_FIRST_SIMPLE; return (Reversed ? do_minus() : do_plus()); };
+    iterator_base<T, Reversed> operator--(int x) { DEBUG_FIRST_SIMPLE; return (Reversed ? do_plus(x) : do_minus(x)); };
+    iterator_base<T, Reversed> operator++(int x) { DEBUG_FIRST_SIMPLE; return (Reversed ? do_minus(x) : do_plus(x)); };
+
+    template<class U, bool R> iterator_base<T, Reversed>& operator=(iterator_base<U, R>&& rhs)
+    {
+      DEBUG_FIRST_SIMPLE;
+      ASSERT(rhs.m_map);
+      if (m_map)
+      {
+        m_map = rhs.m_map;
+        m_lock = rhs.m_lock;
+        guard_type guard(*m_lock);
+        auto need_erase = delayed_dereference();
+        T::operator=(std::move(rhs));
+        reference();
+        if ((need_erase != map_real_end()) && (need_erase != static_cast<T&>(*this)))
+          map_erase(need_erase);
+      }
+      else
+      {
+        m_map = rhs.m_map;
+        m_lock = rhs.m_lock;
+        T::operator=(std::move(rhs));
+        guard_type guard(*m_lock);
+        reference();
+      }
+      return *this;
+    };
+    
+    template<class U, bool R> iterator_base<T, Reversed>& operator=(const iterator_base<U, R>& rhs)
+    {
+      DEBUG_FIRST_SIMPLE;
+      ASSERT(rhs.m_map);
+      if (m_map)
+      {
+        m_map = rhs.m_map;
+        m_lock = rhs.m_lock;
+        guard_type guard(*m_lock);
+        auto need_erase = delayed_dereference();
+        T::operator=(rhs);
+        reference();
+        if ((need_erase != map_real_end()) && (need_erase != static_cast<T&>(*this)))
+          map_erase(need_erase);
+      }
+      else
+      {
+        m_map = rhs.m_map;
+        m_lock = rhs.m_lock;
+        T::operator=(rhs);
+        guard_type guard(*m_lock);
+        reference();
+      }
+      return *this;
+    };
+    
+    template<class U, bool R> iterator_base<T, Reversed>& operator=(iterator_base<U, R>& rhs)
+    {
+      DEBUG_FIRST_SIMPLE;
+      ASSERT(rhs.m_map);
+      if (m_map)
+      {
+        m_map = rhs.m_map;
+        m_lock = rhs.m_lock;
+        guard_type guard(*m_lock);
+        auto need_erase = delayed_dereference();
+        T::operator=(rhs);
+        reference();
+        if ((need_erase != map_real_end()) && (need_erase != static_cast<T&>(*this)))
+          map_erase(need_erase);
+      }
+      else
+      {
+        m_map = rhs.m_map;
+        m_lock = rhs.m_lock;
+        T::operator=(rhs);
+        guard_type guard(*m_lock);
+        reference();
+      }
+      return *this;
+    };
+    
+    template <class R> iterator_base<T, Reversed>& operator=(R rhs)
+    {
+      ASSERT(m_map);
+      guard_type guard(*m_lock);
+      DEBUG_FIRST;
+      auto need_erase = delayed_dereference();
+      T::operator=(rhs);
+      while ((*this != map_real_end()) && ((*this)->second._erase_when_unused))
+        T::operator++();
+      reference();
+      if ((need_erase != map_real_end()) && (need_erase != static_cast<T&>(*this)))
+        map_erase(need_erase);
+      return *this;
+    };
+
+    // Moves to the first element whose key isn't less than k, searching
+    // outward from where the iterator is now (see lower_bound_near).  Meant
+    // for forward scans that skip ahead or get resumed.
+    iterator_base<T, Reversed>& seek(const key_type& k)
+    {
+      static_assert(!Reversed, "seek() is only defined for forward iterators");
+      ASSERT(m_map);
+      guard_type guard(*m_lock);
+      DEBUG_FIRST;
+      auto need_erase = delayed_dereference();
+      T::operator=(lower_bound_near(*m_map, anchor(), k));
+      while ((*this != map_real_end()) && ((*this)->second._erase_when_unused))
+        T::operator++();
+      reference();
+      if ((need_erase != map_real_end()) && (need_erase != *this))
+        map_erase(need_erase);
+      return *this;
+    };
+
+    iterator_base<T, Reversed>& do_minus()
+    {
+      DEBUG_FIRST_SIMPLE;
+      if (circular)
+      {
+        if (iteration != EvenErased)
+          do_increment_or_decrement(FN(decrement_active_circular_core), false);
+        else
+          do_increment_or_decrement(FN(decrement_even_erased_circular_core), false);
+      }
+      else
+      {
+        if (iteration == OnlyForward)
+          do_increment_or_decrement(FN(decrement_forward_core), false);
+        else if ((iteration == ForwardThenBackward) || (iteration == ForwardSameThenBackward))
+          do_increment_or_decrement(FN(decrement_forward_then_backward_core), false);
+        else
+          do_increment_or_decrement(FN(decrement_even_erased_linear_core), false);
+      }
+      return *this;
+    };
+
+    iterator_base<T, Reversed>& do_plus()
+    {
+      DEBUG_FIRST_SIMPLE;
+      if (circular)
+      {
+        if (iteration != EvenErased)
+          do_increment_or_decrement(FN(increment_active_circular_core), true);
+        else
+          do_increment_or_decrement(FN(increment_even_erased_circular_core), true);
+      }
+      else
+      {
+        if (iteration == OnlyForward)
+          do_increment_or_decrement(FN(increment_forward_core), true);
+        else if ((iteration == ForwardThenBackward) || (iteration == ForwardSameThenBackward))
+          do_increment_or_decrement(FN(increment_forward_then_backward_core), true);
+        else
+          do_increment_or_decrement(FN(increment_even_erased_linear_core), true);
+      }
+      return *this;
+    };
+
+    iterator_base<T, Reversed> do_minus(int x)
+    {
+      DEBUG_FIRST_SIMPLE;
+      if (circular)
+      {
+        if (iteration != EvenErased)
+          return do_increment_or_decrement_return(FN(decrement_active_circular_core), false);
+        else
+          return do_increment_or_decrement_return(FN(decrement_even_erased_circular_core), false);
+      }
+      else
+      {
+        if (iteration == OnlyForward)
+          return do_increment_or_decrement_return(FN(decrement_forward_core), false);
+        else if ((iteration == ForwardThenBackward) || (iteration == ForwardSameThenBackward))
+          return do_increment_or_decrement_return(FN(decrement_forward_then_backward_core), false);
+        else
+          return do_increment_or_decrement_return(FN(decrement_even_erased_linear_core), false);
+      }
+    };
+    
+    
+
+    iterator_base<T, Reversed> do_plus(int x)
+    {
+      DEBUG_FIRST_SIMPLE;
+      if (circular)
+      {
+        if (iteration != EvenErased)
+          return do_increment_or_decrement_return(FN(increment_active_circular_core), true);
+        else
+          return do_increment_or_decrement_return(FN(increment_even_erased_circular_core), true);
+      }
+      else
+      {
+        if (iteration == OnlyForward)
+          return do_increment_or_decrement_return(FN(increment_forward_core), true);
+        else if ((iteration == ForwardThenBackward) || (iteration == ForwardSameThenBackward))
+          return do_increment_or_decrement_return(FN(increment_forward_then_backward_core), true);
+        else
+          return do_increment_or_decrement_return(FN(increment_even_erased_linear_core), true);
+      }
+    };
+    
+    iterator_base<T, Reversed>& decrement_active_circular()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(decrement_active_circular_core), false); return *this; };
+    
+    iterator_base<T, Reversed>& increment_active_circular()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(decrement_active_circular_core), false); return *this; };
+
+    iterator_base<T, Reversed>& decrement_forward()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(decrement_forward_core), false); return *this; };
+
+    iterator_base<T, Reversed>& increment_forward()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(increment_forward_core), true); return *this; };
+    
+    iterator_base<T, Reversed>& decrement_forward_then_backward()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(increment_forward_then_backward_core), true); return *this; };
+
+    iterator_base<T, Reversed>& increment_forward_then_backward()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(increment_forward_then_backward_core), true); return *this; };
+
+    iterator_base<T, Reversed>& decrement_even_erased_linear()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(decrement_even_erased_linear_core), false); return *this; };
+
+    iterator_base<T, Reversed>& increment_even_erased_linear()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(increment_even_erased_linear_core), true); return *this; };
+
+    iterator_base<T, Reversed>& decrement_even_erased_circular()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(decrement_even_erased_circular_core), false); return *this; };
+
+    iterator_base<T, Reversed>& increment_even_erased_circular()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement(FN(increment_even_erased_circular_core), true); return *this; };
+
+    iterator_base<T, Reversed>& decrement_active_circular(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(decrement_active_circular_core), false, m_map, m_lock); };
+    
+    iterator_base<T, Reversed>& increment_active_circular(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(decrement_active_circular_core), false, m_map, m_lock); };
+
+    iterator_base<T, Reversed>& decrement_forward(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(decrement_forward_core), false, m_map, m_lock); };
+
+    iterator_base<T, Reversed>& increment_forward(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(increment_forward_core), true, m_map, m_lock); };
+    
+    iterator_base<T, Reversed>& decrement_forward_then_backward(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(increment_forward_then_backward_core), true, m_map, m_lock); };
+
+    iterator_base<T, Reversed>& increment_forward_then_backward(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(increment_forward_then_backward_core), true, m_map, m_lock); };
+
+    iterator_base<T, Reversed>& decrement_even_erased_linear(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(decrement_even_erased_linear_core), false, m_map, m_lock); };
+
+    iterator_base<T, Reversed>& increment_even_erased_linear(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(increment_even_erased_linear_core), true, m_map, m_lock); };
+
+    iterator_base<T, Reversed>& decrement_even_erased_circular(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(decrement_even_erased_circular_core), false, m_map, m_lock); };
+
+    iterator_base<T, Reversed>& increment_even_erased_circular(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_return(FN(increment_even_erased_circular_core), true, m_map, m_lock); };
+
+    iterator_base<T, Reversed>& decrement_active_circular_prelocked()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(decrement_active_circular_core), false); return *this; };
+    
+    iterator_base<T, Reversed>& increment_active_circular_prelocked()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(decrement_active_circular_core), false); return *this; };
+
+    iterator_base<T, Reversed>& decrement_forward_prelocked()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(decrement_forward_core), false); return *this; };
+
+    iterator_base<T, Reversed>& increment_forward_prelocked()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(increment_forward_core), true); return *this; };
+    
+    iterator_base<T, Reversed>& decrement_forward_then_backward_prelocked()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(increment_forward_then_backward_core), true); return *this; };
+
+    iterator_base<T, Reversed>& increment_forward_then_backward_prelocked()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(increment_forward_then_backward_core), true); return *this; };
+
+    iterator_base<T, Reversed>& decrement_even_erased_linear_prelocked()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(decrement_even_erased_linear_core), false); return *this; };
+
+    iterator_base<T, Reversed>& increment_even_erased_linear_prelocked()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(increment_even_erased_linear_core), true); return *this; };
+
+    iterator_base<T, Reversed>& decrement_even_erased_circular_prelocked()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(decrement_even_erased_circular_core), false); return *this; };
+
+    iterator_base<T, Reversed>& increment_even_erased_circular_prelocked()
+      { DEBUG_FIRST_SIMPLE; do_increment_or_decrement_prelocked(FN(increment_even_erased_circular_core), true); return *this; };
+
+    iterator_base<T, Reversed>& decrement_active_circular_prelocked(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(decrement_active_circular_core), false, m_map, m_lock); };
+    
+    iterator_base<T, Reversed>& increment_active_circular_prelocked(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(decrement_active_circular_core), false, m_map, m_lock); };
+
+    iterator_base<T, Reversed>& decrement_forward_prelocked(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(decrement_forward_core), false, m_map, m_lock); };
+
+    iterator_base<T, Reversed>& increment_forward_prelocked(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(increment_forward_core), true, m_map, m_lock); };
+    
+    iterator_base<T, Reversed>& decrement_forward_then_backward_prelocked(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(increment_forward_then_backward_core), true, m_map, m_lock); };
+
+    iterator_base<T, Reversed>& increment_forward_then_backward_prelocked(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(increment_forward_then_backward_core), true, m_map, m_lock); };
+
+    iterator_base<T, Reversed>& decrement_even_erased_linear_prelocked(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(decrement_even_erased_linear_core), false, m_map, m_lock); };
+
+    iterator_base<T, Reversed>& increment_even_erased_linear_prelocked(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(increment_even_erased_linear_core), true, m_map, m_lock); };
+
+    iterator_base<T, Reversed>& decrement_even_erased_circular_prelocked(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(decrement_even_erased_circular_core), false, m_map, m_lock); };
+
+    iterator_base<T, Reversed>& increment_even_erased_circular_prelocked(int)
+      { DEBUG_FIRST_SIMPLE; return do_increment_or_decrement_prelocked_return(FN(increment_even_erased_circular_core), true, m_map, m_lock); };
+
+    iter_map_pointer_type m_map;
+    iter_lock_pointer_type m_lock;
+
+  protected:
+
+    iter_map_pointer_type convert_map_pointer_type(const map_pointer_type& rhs) const
+      { return convert_pointer_type<iter_map_pointer_type, map_pointer_type>(rhs); };
+    iter_lock_pointer_type convert_lock_pointer_type(const lock_pointer_type& rhs) const
+      { return convert_pointer_type<iter_lock_pointer_type, lock_pointer_type>(rhs); };
+
+    template<class U, class V> U convert_pointer_type(const V& rhs) const
+      { return fetch_pointer<U, V>(rhs, DummyB<std::is_pointer<U>::value>()); };
+
+    template<class U, class V> U fetch_pointer(const V& rhs, const DummyB<false>) const { return rhs; };
+    template<class U, class V> U fetch_pointer(const V& rhs, const DummyB<true> ) const { return rhs.get(); };
+    
+    void clear()
+    {
+      if (*this != map_real_end())
+      {
+        decrement_reference();
+        if (!((*this)->second._reference_count) && ((*this)->second._erase_when_unused))
+          map_erase(*this);
+      }
+      m_map = NULL;
+    };
+
+    void do_increment_or_decrement(std::function<void(const T&)> f, bool ascending)
+    { 
+      ASSERT(m_map);
+      guard_type guard(*m_lock);
+      do_increment_or_decrement_helper(f, ascending); 
+    };
+
+    iterator_base<T, Reversed> do_increment_or_decrement_return(std::function<void(const T&)> f, bool ascending)
+    {
+      ASSERT(m_map);
+      guard_type guard(*m_lock);
+      return iterator_base<T, Reversed>(do_increment_or_decrement_helper(f, ascending), m_map, m_lock); 
+    };
+    
+    void do_increment_or_decrement_prelocked(std::function<void(const T&)> f, bool ascending)
+    { 
+      ASSERT(m_map);
+      ASSERT(!m_lock->try_lock());
+      do_increment_or_decrement_helper(f, ascending); 
+    };
+
+    iterator_base<T, Reversed> do_increment_or_decrement_prelocked_return(std::function<void(const T&)> f, bool ascending)
+    {
+      ASSERT(m_map);
+      ASSERT(!m_lock->try_lock());
+      return iterator_base<T, Reversed>(do_increment_or_decrement_helper(f, ascending), m_map, m_lock); 
+    };
+
+    // Unlinked elements (see map::unlink_prelocked) are out of the tree, so
+    // stepping from one starts from where its key is now: the element that
+    // replaced it, or else the gap it left.  Returns true if that's already
+    // where the step ends.
+    bool unlinked() { return (*this != map_real_end()) && (*this)->second._unlinked; };
+    bool settle_unlinked(bool ascending)
+    {
+      T iter = m_map->lower_bound((*this)->first);
+      bool landed = false;
+      if ((iter == map_real_end()) || m_map->key_comp()((*this)->first, iter->first))
+      {
+        if (ascending && (iter != map_real_begin()))
+          --iter;
+        else if (ascending)
+          landed = (iter == map_real_end()) || !iter->second._erase_when_unused;
+      }
+      auto need_erase = delayed_dereference();
+      T::operator=(iter);
+      reference();
+      if (need_erase != map_real_end())
+        map_erase(need_erase);
+      return landed;
+    };
+    T anchor() { return unlinked() ? T(m_map->lower_bound((*this)->first)) : static_cast<T>(*this); };
+    
+    T do_increment_or_decrement_helper(std::function<void(const T&)> f, bool ascending)
+    {
+      DEBUG_FIRST;
+      if (unlinked() && settle_unlinked(ascending))
+        return *this;
+      if (!m_map->size())
+      {
+        T::operator=(map_real_end());
+        return *this;
+      }
+      auto need_erase = delayed_dereference();
+      const T last = *this;
+
+      f(last);
+
+      reference();
+
+      if (need_erase != *this)
+      {
+        if (need_erase != map_real_end())
+        {
+          map_erase(need_erase);
+          return *this;
+        }
+      }
+     
+      return last;
+    };
+
+    void decrement_forward_then_backward_core(const T& last)
+    {
+      DEBUG_FIRST;
+      decrement_forward_core(last);
+      if (*this == (Reversed ? map_real_end() : map_real_begin()))
+      {
+        if (Reversed || (*this)->second._erase_when_unused)
+        {
+          T::operator=(last);
+          if ((iteration == ForwardSameThenBackward) && (!(*this)->second._erase_when_unused))
+            return;
+          increment_forward_core(last);
+        }
+      }
+    };
+    
+    void increment_forward_then_backward_core(const T& last)
+    {
+      DEBUG_FIRST;
+      increment_forward_core(last);
+      auto endpoint = map_real_end();
+      if (Reversed)
+        --endpoint;
+      if (*this == endpoint)
+      {
+        if ((!Reversed) || (*this)->second._erase_when_unused)
+        {
+          T::operator=(last);
+          if ((iteration == ForwardSameThenBackward) && (!(*this)->second._erase_when_unused))
+            return;
+          decrement_forward_core(last);
+        }
+      }
+    };
+    
+    void decrement_even_erased_linear_core(const T& last)
+    {
+      DEBUG_FIRST;
+      if (*this == map_real_begin())
+      {
+        if (Reversed)
+          T::operator=(map_real_end());
+        return;
+      }
+      T::operator--();
+    };
+
+    void increment_even_erased_linear_core(const T& last)
+    {
+      DEBUG_FIRST;
+      if (*this == map_real_end())
+      {
+        if (Reversed)
+          T::operator=(map_real_begin());
+        return;
+      }        
+      T::operator++();
+    };
+
+    void decrement_even_erased_circular_core(const T& last)
+    {
+      DEBUG_FIRST;
+      if (*this == map_real_begin())
+        T::operator=(map_real_end());
+      T::operator--();
+    };
+
+    void increment_even_erased_circular_core(const T& last)
+    {
+      DEBUG_FIRST;
+      if (*this == map_real_end())
+        T::operator=(map_real_begin());
+      else
+      {
+        T::operator++();
+        if (*this == map_real_end())
+          T::operator=(map_real_begin());
+      }
+    };
+
+    void decrement_forward_core(const T& last)
+    {
+      DEBUG_FIRST;
+      if (*this == map_real_begin())
+      {
+        if (Reversed)
+          T::operator=(map_real_end());
+        return;
+      }
+      do 
+        { DEBUG_FIRST; T::operator--(); }
+        while (((*this)->second._erase_when_unused) && (*this != map_real_begin()));
+      if (Reversed)
+      {
+        if ((*this)->second._erase_when_unused)
+          T::operator=(map_real_end());
+      }
+    };
+
+    void increment_forward_core(const T& last)
+    {
+      DEBUG_FIRST;
+      if (*this == map_real_end())
+      {
+        if (Reversed)
+          T::operator=(map_real_begin());
+        else
+          return;
+      }
+      else
+        T::operator++();
+      while ((*this != map_real_end()) && ((*this)->second._erase_when_unused))
+        { DEBUG_FIRST; T::operator++(); } 
+      if ((Reversed) && (*this == map_real_end()))
+        T::operator--();
+    };
+
+    void decrement_active_circular_core(const T& last)
+    {
+      DEBUG_FIRST;
+      if (*this == map_real_begin())
+      {
+        DEBUG_FIRST;
+        T::operator=(map_real_end());
+        T::operator--();
+      }
+      else
+      {
+        if (*this == map_real_end())
+          T::operator--();
+        while (((*this)->second._erase_when_unused) && (*this != map_real_begin()))
+          { DEBUG_FIRST; T::operator--(); }
+        if ((*this)->second._erase_when_unused)
+        {
+          DEBUG_FIRST;
+          T::operator=(map_real_end());
+          if (*this == last)
+            return;
+          T::operator--();
+        }
+      }
+      if ((*this)->second._erase_when_unused)
+      {
+        while ((*this != last) && ((*this)->second._erase_when_unused))
+          { DEBUG_FIRST; T::operator--(); }
+      }
+      if ((*this)->second._erase_when_unused)
+        T::operator=(map_real_end());
+    };
+
+    void increment_active_circular_core(const T& last)
+    {
+      DEBUG_FIRST;
+      if (*this == map_real_end())
+        T::operator=(map_real_begin());
+      else
+        T::operator++();
+      while ((*this != map_real_end()) && ((*this)->second._erase_when_unused))
+        { DEBUG_FIRST; T::operator++(); } 
+      if ((*this == map_real_end()) && (*this != last))
+      {
+        T::operator=(map_real_begin());
+        while ((*this != last) && ((*this)->second._erase_when_unused))
+          { DEBUG_FIRST; T::operator++(); } 
+        if ((*this)->second._erase_when_unused)
+          T::operator=(map_real_end());
+      }
+    };
+
+    void reference()
+    {
+      DEBUG_FIRST_SIMPLE;
+      ASSERT(m_map);
+      if (*this != map_real_end())
+        increment_reference();
+    };
+       
+    void dereference()
+    {
+      DEBUG_FIRST_SIMPLE;
+      ASSERT(m_map);
+      if ((*this != map_real_end()) && !release_shared_reference())
+      {
+        guard_type guard(*m_lock);
+        decrement_reference();
+        if (!((*this)->second._reference_count) && ((*this)->second._erase_when_unused))
+          map_erase(*this);
+      }   
+    }; 
+    // Drops our reference without locking, as long as someone else still
+    // holds one - only the last one out can have an erasure to do.
+    bool release_shared_reference()
+    {
+      auto& count = const_cast<std::atomic<int>&>((*this)->second._reference_count);
+      int current = count.load();
+      while (current > 1)
+        if (count.compare_exchange_weak(current, current - 1))
+          return true;
+      return false;
+    };
+    T delayed_dereference()
+    {
+      ASSERT(m_map);
+      ASSERT(!m_lock->try_lock());
+      DEBUG_FIRST;
+      if (*this != map_real_end())
+      {
+        decrement_reference();
+        if (!((*this)->second._reference_count) && ((*this)->second._erase_when_unused))
+          return static_cast<T>(*this);
+      }
+      return map_real_end();    
+    }; 
+
+    void map_erase(T i)
+    {
+      ASSERT(m_map);
+      DEBUG_FIRST;
+#if __cplusplus >= 201703L
+      if (i->second._unlinked)
+        release_unlinked(&*i);
+      else
+#endif
+        m_map->erase(i);
+    };    
+    T map_real_begin() { ASSERT(m_map); return map_begin(Dummy<T>()); };
+    T map_real_end() { ASSERT(m_map); return map_end(Dummy<T>()); };
+    T map_begin() { ASSERT(m_map); return (Reversed ? map_rbegin(Dummy<T>()) : map_begin(Dummy<T>())); };
+    T map_end() { ASSERT(m_map); return (Reversed ? map_rend(Dummy<T>()) : map_end(Dummy<T>())); };
+    T map_safe_begin() { ASSERT(m_map); return (Reversed ? map_safe_rbegin(Dummy<T>()) : map_begin(Dummy<T>())); };
+    T map_safe_end() { ASSERT(m_map); return (Reversed ? map_safe_rend(Dummy<T>()) : map_end(Dummy<T>())); };
+    base_iterator map_begin(Dummy<base_iterator>) { return m_map->begin(); };
+    base_iterator map_end(Dummy<base_iterator>) { return m_map->end(); };
+    base_const_iterator map_begin(Dummy<base_const_iterator>) { return m_map->cbegin(); };
+    base_const_iterator map_end(Dummy<base_const_iterator>) { return m_map->cend(); };
+    base_iterator map_safe_rbegin(Dummy<base_iterator>) { return m_map->end(); };
+    base_iterator map_safe_rend(Dummy<base_iterator>) { auto iter = m_map->end(); if (m_map->size()) --iter; return iter; };
+    base_const_iterator map_safe_rbegin(Dummy<base_const_iterator>) { return m_map->cend(); };
+    base_const_iterator map_safe_rend(Dummy<base_const_iterator>) { auto iter = m_map->cend(); if (m_map->size()) --iter; return iter; };
+    base_iterator map_rbegin(Dummy<base_iterator>) { return m_map->end(); };
+    base_iterator map_rend(Dummy<base_iterator>) { auto iter = m_map->end(); --iter; return iter; };
+    base_const_iterator map_rbegin(Dummy<base_const_iterator>) { return m_map->cend(); };
+    base_const_iterator map_rend(Dummy<base_const_iterator>) { auto iter = m_map->cend(); --iter; return iter; };
+
+    void decrement_reference()
+    {
+      DEBUG_REFCOUNT;
+      --const_cast<std::atomic<int>&>((*this)->second._reference_count);
+      ASSERT((*this)->second._reference_count >= 0);
+    };
+
+    void increment_reference()
+    {
+      DEBUG_REFCOUNT;
+      ++const_cast<std::atomic<int>&>((*this)->second._reference_count);
+    };
+
+  };
+
+  //////////////////////////////////////////
+  // Main portion of "map" begins here.
+  //////////////////////////////////////////
+  
+  typedef iterator_base<base_iterator, false>		iterator;
+  typedef iterator_base<base_const_iterator, false>	const_iterator;
+  typedef iterator_base<base_iterator, true>		reverse_iterator;
+  typedef iterator_base<base_const_iterator, true>	const_reverse_iterator;
+
+  explicit map(const Compare& comp = Compare(), const Allocator& alloc = Allocator()) : 
+    m_map(new std::map<key_type, safe_mapped_type>(comp, alloc)),
+    m_lock(new mutex_type())
+    { DEBUG_SIMPLE; };
+
+  explicit map(const Allocator& alloc) : 
+    m_map(new std::map<key_type, safe_mapped_type>(alloc)),
+    m_lock(new mutex_type())
+    { DEBUG_SIMPLE; };
+
+  map(const std::map<key_type, safe_mapped_type>& other) : 
+    m_map(new std::map<key_type, safe_mapped_type>(other)),
+    m_lock(new mutex_type())
+    { DEBUG_SIMPLE; };
+  
+  template<class InputIterator> 
+  map(InputIterator first, InputIterator last, const Compare& comp = Compare(), const Allocator& alloc = Allocator()) :
+    m_map(new std::map<key_type, safe_mapped_type>(first, last, comp, alloc)),
+    m_lock(new mutex_type())
+    { DEBUG_SIMPLE; };
+
+  template<class InputIterator>
+  map(InputIterator first, InputIterator last, const Allocator& alloc) : 
+    m_map(new std::map<key_type, safe_mapped_type>(first, last, alloc)),
+    m_lock(new mutex_type())
+    { DEBUG_SIMPLE; };
+
+  map(const std::map<key_type, safe_mapped_type>& other, const Allocator& alloc) : 
+    m_map(new std::map<key_type, safe_mapped_type>(other, alloc)),
+    m_lock(new mutex_type())
+    { DEBUG_SIMPLE; };
+
+  map(const std::map<key_type, safe_mapped_type>&& other) : 
+    m_map(new std::map<key_type, safe_mapped_type>(other)),
+    m_lock(new mutex_type())
+    { DEBUG_SIMPLE; };
+
+  map(const std::map<key_type, safe_mapped_type>&& other, const Allocator& alloc) : 
+    m_map(new std::map<key_type, safe_mapped_type>(other, alloc)),
+    m_lock(new mutex_type())
+    { DEBUG_SIMPLE; };
+
+  map(const safe::map<key_type, mapped_type>& other, const Compare& comp = Compare(), const Allocator& alloc = Allocator()) :
+    m_map(new std::map<key_type, safe_mapped_type>(comp, alloc)),
+    m_lock(new mutex_type())
+    { DEBUG_SIMPLE; operator=(other); };
+  
+  map(const safe::map<key_type, mapped_type>& other, const Allocator& alloc) : 
+    m_map(new std::map<key_type, safe_mapped_type>(alloc)),
+    m_lock(new mutex_type())
+    { DEBUG_SIMPLE; operator=(other); };
+
+  map(safe::map<key_type, mapped_type>&& other, const Compare& comp = Compare(), const Allocator& alloc = Allocator()) : 
+    m_map(new std::map<key_type, safe_mapped_type>(comp, alloc)),
+    m_lock(new mutex_type())
+    { DEBUG_SIMPLE; operator=(other); };
+
+  map(safe::map<key_type, mapped_type>&& other, const Allocator& alloc) : 
+    m_map(new std::map<key_type, safe_mapped_type>(alloc)),
+    m_lock(new mutex_type())
+    { DEBUG_SIMPLE; operator=(other); };
+
+  map(const std::map<key_type, mapped_type>& other, const Compare& comp = Compare(), const Allocator& alloc = Allocator()) :
+    m_map(new std::map<key_type, safe_mapped_type>(comp, alloc)),
+    m_lock(new mutex_type())
+    { DEBUG_SIMPLE; operator=(other); };
+  
+  map(const std::map<key_type, mapped_type>& other, const Allocator& alloc) : 
+    m_map(new std::map<key_type, safe_mapped_type>(alloc)),
+    m_lock(new mutex_type())
+    { DEBUG_SIMPLE; operator=(other); };
+
+  map(std::initializer_list<value_type> init, const Compare& comp = Compare(), const Allocator& alloc = Allocator()) : 
+    m_map(new std::map<key_type, safe_mapped_type>(comp, alloc)),
+    m_lock(new mutex_type())
+    { DEBUG_SIMPLE; operator=(init); };
+
+  map(std::initializer_list<value_type> init, const Allocator& alloc) : 
+    m_map(new std::map<key_type, safe_mapped_type>(alloc)),
+    m_lock(new mutex_type())
+    { DEBUG_SIMPLE; operator=(init); };
+
+  ~map()
+  {
+    DEBUG_SIMPLE;
+    if (m_checkpointer.joinable())	// It writes through this, so let it finish
+      m_checkpointer.join();
+  };
+ 
+  safe_mapped_type& at(const key_type& k)
+    { DEBUG_SIMPLE; filter_or_throw(k); GUARD; return touch(k, m_map->at(k)); };
+  const safe_mapped_type& at(const key_type& k) const
+    { DEBUG_SIMPLE; filter_or_throw(k); GUARD; return touch(k, m_map->at(k)); };
+  iterator begin() noexcept
+    { DEBUG_SIMPLE; GUARD; return iterator(m_map->begin(), m_map, m_lock); };
+  const_iterator cbegin() const noexcept
+    { DEBUG_SIMPLE; GUARD; return const_iterator(m_map->cbegin(), m_map, m_lock); };
+  const_iterator cend() const noexcept
+    { DEBUG_SIMPLE; GUARD; return const_iterator(m_map->cend(), m_map, m_lock); };
+  size_type count(const key_type& k) const
+    { DEBUG_SIMPLE; if (filtered_out(k)) return 0; GUARD_COUNT; return m_map->count(k); };
+  const_reverse_iterator crbegin() const noexcept
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    auto tmp = m_map->cend();
+    if (m_map->size())
+       --tmp;
+    return const_reverse_iterator(std::move(tmp), m_map, m_lock);
+  };
+  const_reverse_iterator crend() const noexcept
+    { DEBUG_SIMPLE; GUARD; return const_reverse_iterator(m_map->cend(), m_map, m_lock); };
+  template <class... Args> std::pair<iterator, bool> emplace(Args&&... args)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    auto ret = emplace_prelocked(is_key_value<Args...>(), std::forward<Args>(args)...);
+    admit_prelocked(ret);
+    return std::make_pair(iterator(ret.first, m_map, m_lock), ret.second);
+  };
+  template <class... Args> iterator emplace_hint(const_iterator position, Args&&... args)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    const size_type before = m_map->size();
+    auto ret = std::make_pair(m_map->emplace_hint(anchor_prelocked<base_const_iterator>(position), std::forward<Args>(args)...), false);
+    ret.second = (m_map->size() != before);
+    admit_prelocked(ret);
+    return iterator(ret.first, m_map, m_lock);
+  };
+  bool empty() const noexcept { return m_map->empty(); };
+  iterator end() noexcept
+    { DEBUG_SIMPLE; GUARD; return iterator(m_map->end(), m_map, m_lock); };
+  const_iterator end() const noexcept
+    { DEBUG_SIMPLE; GUARD; return iterator(m_map->end(), m_map, m_lock); };
+  std::pair<const_iterator, const_iterator> equal_range(const key_type& k) const
+    { DEBUG_SIMPLE; GUARD; auto ret = m_map->equal_range(k); return std::make_pair(const_iterator(ret.first, m_map, m_lock), const_iterator(ret.second, m_map, m_lock)); };
+  std::pair<iterator, iterator> equal_range(const key_type& k)
+    { DEBUG_SIMPLE; GUARD; auto ret = m_map->equal_range(k); return std::make_pair(iterator(ret.first, m_map, m_lock), iterator(ret.second, m_map, m_lock)); };
+  iterator find(const key_type& k)
+  {
+    DEBUG_SIMPLE;
+    if (filtered_out(k))
+      return iterator(m_map, m_lock);
+    GUARD;
+    return iterator(find_prelocked(k), m_map, m_lock);
+  };
+  const_iterator find(const key_type& k) const
+  {
+    DEBUG_SIMPLE;
+    if (filtered_out(k))
+      return const_iterator(m_map, m_lock);
+    GUARD;
+    return const_iterator(find_prelocked(k), m_map, m_lock);
+  };
+  // find(k), but searching outward from position instead of down from the
+  // root - cheap when k is known to be near it.
+  template <class U, bool V> iterator_base<U, V> find_near(const iterator_base<U, V>& position, const key_type& k) const
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    ASSERT(&*position.m_map == &*m_map);
+    U iter = lower_bound_near(*m_map, anchor_prelocked<U>(position), k);
+    if ((iter == m_map->end()) || m_map->key_comp()(k, iter->first) || iter->second._erase_when_unused)
+      iter = m_map->end();
+    return iterator_base<U, V>(iter, m_map, m_lock);
+  };
+  // Multi-key lookup: [first, last) should be sorted by the map's ordering.
+  // The lock is taken once, and each search starts from where the last one
+  // ended rather than from the root.  The iterator versions give one iterator
+  // per key (end() if it's absent); the value_type version copies out the
+  // entries that were found.  All return the number of keys found.
+  template <class InputIterator> size_type find_many(InputIterator first, InputIterator last, std::vector<iterator>& out)
+    { DEBUG_SIMPLE; return find_many_helper(first, last, out); };
+  template <class InputIterator> size_type find_many(InputIterator first, InputIterator last, std::vector<const_iterator>& out) const
+    { DEBUG_SIMPLE; return find_many_helper(first, last, out); };
+  template <class InputIterator> size_type find_many(InputIterator first, InputIterator last, std::vector<value_type>& out) const
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    std::vector<base_iterator> hits;
+    const size_type found = find_many_prelocked(first, last, hits);
+    out.reserve(out.size() + found);
+    for (auto& i : hits)
+      if (i != m_map->end())
+        out.push_back(value_type(i->first, static_cast<const mapped_type&>(i->second)));
+    return found;
+  };
+  std::pair<iterator, bool> insert(const value_type& val)
+    { DEBUG_SIMPLE; GUARD; auto ret = emplace_prelocked(std::true_type(), val.first, val.second); admit_prelocked(ret); return std::make_pair(iterator(ret.first, m_map, m_lock), ret.second); };
+  std::pair<iterator, bool> insert(value_type&& val)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    auto ret = emplace_prelocked(std::true_type(), val.first, std::move(val.second));
+    admit_prelocked(ret);
+    return std::make_pair(iterator(ret.first, m_map, m_lock), ret.second);
+  };
+  template <class P> std::pair<iterator, bool> insert(P&& val)
+    { DEBUG_SIMPLE; GUARD; auto ret = m_map->insert(safe_value(val)); admit_prelocked(ret); return std::make_pair(iterator(ret.first, m_map, m_lock), ret.second); };
+  iterator insert(const_iterator position, const value_type& val)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    const size_type before = m_map->size();
+    auto ret = std::make_pair(m_map->insert(anchor_prelocked<base_const_iterator>(position), safe_value(val)), false);
+    ret.second = (m_map->size() != before);
+    admit_prelocked(ret);
+    return iterator(ret.first, m_map, m_lock);
+  };
+  template <class InputIterator> void insert(InputIterator first, InputIterator last)
+  {
+    DEBUG_SIMPLE;
+    GUARD; 
+    for (auto iter = first; iter != last; ++iter)
+      admit_prelocked(m_map->insert(*iter));
+  };
+  template <class U, bool V> void insert(const iterator_base<U, V>& first, const iterator_base<U, V>& last)
+  {
+    DEBUG_SIMPLE;
+    ASSERT(first.m_map == last.m_map); 
+    GUARD; 
+    for (auto iter = first; iter != last; ++iter)
+      admit_prelocked(m_map->insert(*iter));
+  };
+  void insert(std::initializer_list<value_type> il)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    for (auto & i : il)
+      admit_prelocked(m_map->insert(i));
+  };
+  key_compare key_comp() const { return m_map->key_comp(); };
+  iterator lower_bound(const key_type& k)
+    { DEBUG_SIMPLE; GUARD; return iterator(m_map->lower_bound(k), m_map, m_lock); };
+  const_iterator lower_bound(const key_type& k) const
+    { DEBUG_SIMPLE; GUARD; return const_iterator(m_map->lower_bound(k), m_map, m_lock); };
+  size_type max_size() const noexcept { return m_map->max_size(); };
+  map<key_type, mapped_type>& operator=(const map<key_type, mapped_type>& x)
+  {
+    DEBUG_SIMPLE;
+    if (&x == this)
+      return *this;
+    GUARD_PAIR(*this, x);
+    clear_prelocked();
+    for (auto& i : *x.m_map)
+    {
+      auto second = i.second;
+      if (!second._erase_when_unused)
+      {
+        second._reference_count = 0;
+        note_insert_prelocked(m_map->emplace(i.first, second));
+      }
+    }
+    return *this;
+  };
+  map<key_type, mapped_type>& operator=(const std::map<key_type, mapped_type>& x)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    clear_prelocked();
+    for (auto& i : x)
+      note_insert_prelocked(m_map->emplace(i.first, safe_mapped_type(i.second)));
+    return *this;
+  };
+  map<key_type, mapped_type>& operator=(map<key_type, mapped_type>&& x)
+  {
+    DEBUG_SIMPLE;
+    if (&x == this)
+      return *this;
+    GUARD_PAIR(*this, x);
+    clear_prelocked();	// Wish I could just call swap on the map and lock, but there's no way to make that work without a double dereference pointer setup, which would hurt performance.
+    for (auto& i : *x.m_map)
+    {
+      auto second = i.second;
+      if (!second._erase_when_unused)
+      {
+        second._reference_count = 0;
+        note_insert_prelocked(m_map->emplace(i.first, second));
+      }
+    }
+    return *this;
+  };
+  map<key_type, mapped_type>& operator=(std::map<key_type, mapped_type>&& x)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    clear_prelocked();
+    for (auto i = x.m_map->begin(); i != x.m_map->end(); ++i)
+      note_insert_prelocked(m_map->insert(*i));
+    return *this;
+  };
+  map<key_type, mapped_type>& operator=(std::initializer_list<value_type> il)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    clear_prelocked();
+    for (auto& val : il)
+      note_insert_prelocked(m_map->insert(safe_value(val)));
+    return *this;
+  };
+  safe_mapped_type& operator[](const key_type& k)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    if (m_feeds.empty() && !m_clock && !m_filter && !m_journal && m_cuts.empty())
+      return m_map->operator[](k);
+    auto ret = m_map->emplace(k, mapped_type());
+    note_insert_prelocked(ret, false);
+    return touch(ret.first->first, ret.first->second);
+  };
+  safe_mapped_type& operator[](key_type&& k)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    if (m_feeds.empty() && !m_clock && !m_filter && !m_journal && m_cuts.empty())
+      return m_map->operator[](std::forward<key_type>(k));
+    auto ret = m_map->emplace(std::forward<key_type>(k), mapped_type());
+    note_insert_prelocked(ret, false);
+    return touch(ret.first->first, ret.first->second);
+  };
+  reverse_iterator rbegin() noexcept
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    auto tmp = m_map->end();
+    if (m_map->size())
+       --tmp;
+    return reverse_iterator(std::move(tmp), m_map, m_lock);
+  };
+  const_reverse_iterator rbegin() const noexcept
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    auto tmp = m_map->end();
+    if (m_map->size())
+       --tmp;
+    return const_reverse_iterator(std::move(tmp), m_map, m_lock);
+  };
+  reverse_iterator rend() noexcept
+    { DEBUG_SIMPLE; GUARD; return reverse_iterator(m_map->end(), m_map, m_lock); };
+  const_reverse_iterator rend() const noexcept
+    { DEBUG_SIMPLE; GUARD; return const_reverse_iterator(m_map->rend(), m_map, m_lock); };
+  size_type size() const noexcept
+    { DEBUG_SIMPLE; GUARD_SIZE; return m_map->size(); };
+  void swap(map<key_type, mapped_type>& x)
+  {
+    DEBUG_SIMPLE;
+    if (&x == this)
+      return;
+    map tmp(m_map->key_comp());
+    GUARD_PAIR(*this, x);
+    tmp.transfer_prelocked(*this);
+    transfer_prelocked(x);
+    x.transfer_prelocked(tmp);
+  };
+  void swap(std::map<key_type, mapped_type>& x)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    std::map<key_type, mapped_type> tmp;
+    for (auto iter = m_map->begin(); iter != m_map->end(); )
+    {
+      if (!iter->second._erase_when_unused)
+      {
+        tmp.emplace(iter->first, iter->second);
+        note_erase_prelocked(*iter);
+        if (!iter->second._reference_count)
+        {
+          iter = m_map->erase(iter);
+          continue;
+        }
+        else
+          iter->second._erase_when_unused = true;
+      }
+      ++iter;
+    }
+    for (auto& i : x)
+      note_insert_prelocked(m_map->emplace(i.first, i.second));
+    tmp.swap(x);
+  };
+  iterator upper_bound(const key_type& k)
+    { DEBUG_SIMPLE; GUARD; return iterator(m_map->upper_bound(k), m_map, m_lock); };
+  const_iterator upper_bound(const key_type& k) const
+    { DEBUG_SIMPLE; GUARD; return const_iterator(m_map->upper_bound(k), m_map, m_lock); };
+  value_compare value_comp() const { return m_map->value_comp(); };
+
+  void clear() noexcept
+  {
+    GUARD;
+    clear_prelocked();
+  };
+  
+  void clear_fast() noexcept
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    for (auto iter = m_map->begin(); iter != m_map->end(); ++iter)
+      flag_prelocked(*iter);
+  };
+  
+  size_type erase(const key_type& k)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    auto iter = m_map->find(k);
+    if (iter != m_map->end())
+    {
+      erase_prelocked(iter);
+      return 1;
+    }
+    else
+      return 0;
+  };
+
+  size_type erase_fast(const key_type& k)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    auto iter = m_map->find(k);
+    if (iter != m_map->end())
+    {
+      flag_prelocked(*iter);
+      return 1;
+    }
+    else
+      return 0;
+  };
+
+  iterator_base<base_iterator, false> erase(iterator_base<base_iterator, false> position) { DEBUG_SIMPLE; GUARD; return erase_prelocked(position); };
+  template <class U, bool V> iterator_base<U, V> erase(iterator_base<U, V>& position) { DEBUG_SIMPLE; GUARD; return erase_prelocked(position); };
+
+  void erase_fast(iterator_base<base_iterator, false> position) { DEBUG_SIMPLE; GUARD; flag_prelocked(*position); };
+  template <class U, bool V> void erase_fast(iterator_base<U, V>& position) { DEBUG_SIMPLE; GUARD; flag_prelocked(const_cast<safe_value_type&>(*position)); };
+
+  template <class U, bool V> const iterator_base<U, V> erase(const iterator_base<U, V>& first, const iterator_base<U, V>& last)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    ASSERT(first.m_map == last.m_map);
+    auto iter = anchor_prelocked<base_iterator>(V ? last : first);
+    auto end = anchor_prelocked<base_iterator>(V ? first : last);
+    for (; iter != end; )
+    {
+      ASSERT(iter != m_map->end());
+      if (!iter->second._erase_when_unused)
+      {
+        note_erase_prelocked(*iter);
+        if (!iter->second._reference_count)
+        {
+          iter = m_map->erase(iter);
+          continue;
+        }
+        else
+          iter->second._erase_when_unused = true;
+      }
+      ++iter;
+    }
+    return iterator_base<U, V>(iter, m_map, m_lock);
+  };
+
+  template <class T> T erase_fast(const T& first, const T& last)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    ASSERT(first.m_map == last.m_map);
+    auto iter = first;
+    for (; iter != last; ++iter)
+      flag_prelocked(*iter);
+    return iter;
+  };
+
+  // Point-in-time copy of the live entries, taken the way checkpoint_async()
+  // takes its cut: the lock's held a block at a time, and writers keep the
+  // old versions of keys the copy hasn't reached yet.  The snapshot can then
+  // be read (or scanned for as long as you like) without ever locking again.
+  frozen_map<key_type, mapped_type, Compare> snapshot() const
+    { DEBUG_SIMPLE; return frozen_map<key_type, mapped_type, Compare>(*this, m_map->key_comp()); };
+
+  // snapshot()'s copy, appended to values in key order.
+  void copy_cut(std::vector<value_type>& values) const
+  {
+    DEBUG_SIMPLE;
+    cut_state cut(m_map->key_comp());
+    {
+      GUARD;
+      values.reserve(values.size() + m_map->size());
+      m_cuts.push_back(&cut);
+    }
+    try
+    {
+      for (bool more = true; more; )
+      {
+        GUARD;
+        more = cut_block_prelocked(cut, [&](const key_type& k, const mapped_type& v) { values.emplace_back(k, v); });
+        if (!more)
+          forget_cut_prelocked(&cut);
+      }
+    }
+    catch (...)
+    {
+      GUARD;
+      forget_cut_prelocked(&cut);
+      throw;
+    }
+  };
 
-    template<class U, class V> U convert_pointer_type(const V& rhs) const
-      { return fetch_pointer<U, V>(rhs, DummyB<std::is_pointer<U>::value>()); };
+  // Change feed: every insertion, erasure and update made through the map
+  // (not through references or iterators into it) is published to each
+  // subscriber's queue, as is the reclaiming of flagged elements when the map
+  // itself does it.
+  typedef change_feed<key_type, mapped_type> feed_type;
+  std::shared_ptr<feed_type> subscribe(size_t capacity = 1024, bool with_values = false)
+  {
+    DEBUG_SIMPLE;
+    auto ret = std::make_shared<feed_type>(capacity, with_values);
+    GUARD;
+    m_feeds.push_back(ret);
+    return ret;
+  };
+  void unsubscribe(const std::shared_ptr<feed_type>& feed)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    m_feeds.erase(std::remove(m_feeds.begin(), m_feeds.end(), feed), m_feeds.end());
+  };
 
-    template<class U, class V> U fetch_pointer(const V& rhs, const DummyB<false>) const { return rhs; };
-    template<class U, class V> U fetch_pointer(const V& rhs, const DummyB<true> ) const { return rhs.get(); };
-    
-    void clear()
+  // Entries with a time to live.  They're erased (or flagged, if pinned) by
+  // expire(), which costs in proportion to how many have expired rather than
+  // the size of the map.  cleanup() and emplace_with_ttl() call it too.
+  // Erasing the key some other way cancels its TTL.
+  std::pair<iterator, bool> emplace_with_ttl(const key_type& k, const mapped_type& v, std::chrono::milliseconds ttl)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    expire_prelocked();
+    base_iterator iter;
+    if (find_live_prelocked(k, iter))
+      return std::make_pair(iterator(iter, m_map, m_lock), false);
+    iter = place_prelocked(iter, k, v);
+    set_ttl_prelocked(k, ttl);
+    return std::make_pair(iterator(iter, m_map, m_lock), true);
+  };
+  // Gives an existing entry a new TTL, whether or not it had one.
+  bool set_ttl(const key_type& k, std::chrono::milliseconds ttl)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    base_iterator iter;
+    if (!find_live_prelocked(k, iter))
+      return false;
+    set_ttl_prelocked(k, ttl);
+    return true;
+  };
+  size_type expire()
+    { DEBUG_SIMPLE; GUARD; return expire_prelocked(); };
+
+  // Bounded mode: once the map holds more than max_entries elements (or more
+  // than max_bytes of nodes, not counting anything the keys and values own
+  // on the heap), inserting evicts by CLOCK.  Lookups through find(), at()
+  // and [] set an element's reference bit, and the hand, sweeping round in
+  // key order, clears bits until it finds one unset.  Elements pinned by an
+  // iterator are passed over.  Zero for both removes the bound.
+  void set_capacity(size_type max_entries, size_type max_bytes = 0)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    if (max_bytes)
     {
-      if (*this != map_real_end())
+      const size_type for_bytes = std::max<size_type>(max_bytes / node_bytes, 1);
+      max_entries = max_entries ? std::min(max_entries, for_bytes) : for_bytes;
+    }
+    if (!max_entries)
+    {
+      m_clock.reset();
+      return;
+    }
+    if (!m_clock)
+      m_clock = std::make_shared<clock_state>();
+    m_clock->capacity = max_entries;
+    evict_prelocked(m_map->end());
+  };
+  size_type capacity() const { return m_clock ? m_clock->capacity : 0; };
+
+  // TinyLFU admission, for bounded maps: a count-min sketch tracks how often
+  // keys are looked up, and emplace() or insert() of a new key that would
+  // evict something only succeeds if the new key has been seen more often
+  // than the victim (otherwise it returns end() and false).  So a scan of
+  // one-off keys can't flush out the working set.  width is the number of
+  // counters per row; a few times the capacity is about right.
+  template <class Hash = std::hash<key_type>> void enable_admission(size_type width = 0, const Hash& hash = Hash())
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    m_sketch = std::make_shared<frequency_sketch<key_type>>(width ? width : std::max<size_type>(4 * capacity(), 64), hash);
+  };
+  void disable_admission()
+    { DEBUG_SIMPLE; GUARD; m_sketch.reset(); };
+
+  // find(), through a small per-thread cache of recent hits.  Each entry holds
+  // a pinned iterator and the map's generation when it was found; any insert
+  // or erase bumps the generation, so a repeat lookup with nothing changed in
+  // between is answered with no lock and no search.  Cached entries keep
+  // their nodes pinned (so an erased one lingers, flagged, until it's pushed
+  // out of the cache), which is also why this needs SharedPointer iterators.
+  iterator find_cached(const key_type& k)
+  {
+    DEBUG_SIMPLE;
+    static_assert(destructor == SharedPointer, "find_cached() needs iterators that keep the map alive");
+    auto& cache = lookup_cache();
+    const uint64_t generation = m_generation.load(std::memory_order_acquire);
+    const auto comp = m_map->key_comp();
+    cache_entry* slot = nullptr;
+    for (auto& i : cache)
+      if ((i.map == m_map.get()) && !comp(k, i.iter->first) && !comp(i.iter->first, k))
       {
-        decrement_reference();
-        if (!((*this)->second._reference_count) && ((*this)->second._erase_when_unused))
-          map_erase(*this);
+        if (i.generation == generation)
+          return i.iter;
+        slot = &i;
+        break;
       }
-      m_map = NULL;
-    };
+    iterator ret = find(k);
+    if (static_cast<const base_iterator&>(ret) == m_map->end())
+      return ret;
+    if (!slot && (cache.size() < cache_size))
+      cache.push_back(cache_entry{m_map.get(), generation, ret});
+    else
+    {
+      if (!slot)
+        slot = &cache[cache_victim()++ % cache_size];
+      slot->map = m_map.get();
+      slot->generation = generation;
+      slot->iter = ret;
+    }
+    return ret;
+  };
 
-    void do_increment_or_decrement(std::function<void(const T&)> f)
-    { 
-      ASSERT(m_map);
-      guard_type guard(*m_lock);
-      do_increment_or_decrement_helper(f); 
-    };
+  // Negative-lookup filter: a Bloom filter of the keys, checked before the
+  // lock is taken, so find(), count() and at() of a key that isn't there
+  // usually return without locking at all.  Bloom filters can't forget keys,
+  // so cleanup() rebuilds it; it's also rebuilt bigger whenever the map grows
+  // to twice what it was sized for.
+  template <class Hash = std::hash<key_type>> void enable_negative_filter(size_type expected = 0, const Hash& hash = Hash())
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    if (!m_filter_storage)
+      m_filter_storage = std::make_shared<std::vector<std::shared_ptr<filter_type>>>();
+    m_filter_storage->push_back(std::make_shared<filter_type>(std::max<size_type>(std::max<size_type>(expected, 2 * m_map->size()), 1024), hash));
+    m_filter_storage->back()->rebuild(m_map->begin(), m_map->end());
+    m_filter.store(m_filter_storage->back().get());
+  };
 
-    iterator_base<T, Reversed> do_increment_or_decrement_return(std::function<void(const T&)> f)
+  // Binary dump of the live entries, in key order: a magic number, then
+  // blocks of up to serial_block_size records, each block headed by its
+  // record count and byte length, and a zero block at the end.  The lock's
+  // only held while a block is encoded, never while it's written, so writers
+  // carry on meanwhile - which also means the dump isn't one consistent cut
+  // (serialize a snapshot() for that).  serial_format::compact writes
+  // integer keys and values as varints, the keys as differences from the
+  // one before; deserialize() takes either.  False if the stream failed.
+  bool serialize(std::ostream& out, const serial_format format = serial_format::fixed) const
+  {
+    DEBUG_SIMPLE;
+    const bool compact = (format == serial_format::compact);
+    serial_writer writer(out);
+    writer.put(serial_magic(compact), serial_magic_size);
+    std::unique_ptr<key_type> last;	// Where the next block carries on from
+    for (bool more = true; more; )
     {
-      ASSERT(m_map);
-      guard_type guard(*m_lock);
-      return iterator_base<T, Reversed>(do_increment_or_decrement_helper(f), m_map, m_lock); 
-    };
-    
-    void do_increment_or_decrement_prelocked(std::function<void(const T&)> f)
-    { 
-      ASSERT(m_map);
-      ASSERT(!m_lock->try_lock());
-      do_increment_or_decrement_helper(f); 
-    };
+      const size_t header = writer.size();
+      writer.put_u32(0);
+      writer.put_u32(0);
+      uint32_t count = 0;
+      {
+        GUARD;
+        auto iter = last ? m_map->upper_bound(*last) : m_map->begin();
+        auto previous = m_map->end();
+        for (; (iter != m_map->end()) && (count < serial_block_size); ++iter)
+          if (!iter->second._erase_when_unused)
+          {
+            write_record(writer, compact, iter->first, iter->second, (previous != m_map->end()) ? &previous->first : nullptr);
+            previous = iter;
+            ++count;
+          }
+        more = (iter != m_map->end());
+        if (previous != m_map->end())
+          last.reset(new key_type(previous->first));
+      }
+      writer.patch_u32(header, count);
+      writer.patch_u32(header + 4, writer.size() - header - 8);
+      if (count && !more)
+      {
+        writer.put_u32(0);
+        writer.put_u32(0);
+      }
+      if (!writer.flush())
+        return false;
+    }
+    return true;
+  };
+
+  // Replaces the contents with a serialize() dump.  Each block's parsed
+  // without the lock and then added in one go, through the sorted bulk path
+  // (each record goes in next to the one before, no search from the root).
+  // False on a bad or truncated dump, in which case the map keeps whatever
+  // had been loaded so far - or, if it's not a dump at all, is left alone.
+  bool deserialize(std::istream& in)
+  {
+    DEBUG_SIMPLE;
+    serial_reader reader(in);
+    return deserialize(reader);
+  };
 
-    iterator_base<T, Reversed> do_increment_or_decrement_prelocked_return(std::function<void(const T&)> f)
+  // A durable checkpoint: serializes into path + ".tmp", syncs it and
+  // renames it over path, so path always holds one whole checkpoint, this
+  // one or the one before.  (The tree itself lives on the heap; this is the
+  // restart point, not a file-backed map.)  False if any step failed.
+  bool save(const std::string& path, const serial_format format = serial_format::fixed) const
+  {
+    DEBUG_SIMPLE;
+    const std::string temporary = path + ".tmp";
     {
-      ASSERT(m_map);
-      ASSERT(!m_lock->try_lock());
-      return iterator_base<T, Reversed>(do_increment_or_decrement_helper(f), m_map, m_lock); 
-    };
-    
-    T do_increment_or_decrement_helper(std::function<void(const T&)> f)
+      std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+      if (!out || !serialize(out, format) || !out.flush())
+        return false;
+    }
+    return durable_rename(temporary, path);
+  };
+
+  // Replaces the contents with a save()d checkpoint, as deserialize() does,
+  // but maps the file in (read ahead sequentially) and parses the records
+  // straight out of the mapped pages, with no stream or buffer copy.
+  bool load(const std::string& path)
+  {
+    DEBUG_SIMPLE;
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat status;
+    const size_t size = fstat(fd, &status) ? 0 : status.st_size;
+    void* p = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED)	// Not something that maps; read it as a stream
     {
-      DEBUG_FIRST;
-      if (!m_map->size())
-      {
-        T::operator=(map_real_end());
-        return *this;
-      }
-      auto need_erase = delayed_dereference();
-      const T last = *this;
+      std::ifstream in(path, std::ios::binary);
+      return in && deserialize(in);
+    }
+    madvise(p, size, MADV_SEQUENTIAL);
+    serial_reader reader(static_cast<const char*>(p), size);
+    const bool loaded = deserialize(reader);
+    munmap(p, size);
+    return loaded;
+  };
 
-      f(last);
+  // Write-ahead log: from here on every insert and erase - by emplace,
+  // insert, erase, upsert, update_if_present, expiry or eviction - appends
+  // a record to the file at path.  Changes made in place through an
+  // iterator, at() or operator[] aren't seen, and neither is the element
+  // operator[] adds for a missing key, so use upsert() for those.
+  // Appending is just a copy under the lock; a flusher thread writes and
+  // fsyncs in batches, and sync() waits for everything so far to be on
+  // disk, one fsync shared by everyone waiting.  Opening replays what's
+  // already there (path.old, then path) on top of the current contents, so
+  // load() the last checkpoint first.  False if it's already on or the files
+  // can't be read or opened.
+  bool enable_journal(const std::string& path)
+  {
+    static_assert(journalable::value, "the journal needs keys and values that serialize() can write");
+    DEBUG_SIMPLE;
+    GUARD;
+    if (m_journal || !replay_prelocked(path + ".old") || !replay_prelocked(path))
+      return false;
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+      return false;
+    m_journal = std::make_shared<journal_state>(fd, path);
+    return true;
+  };
 
-      reference();
+  bool disable_journal()	// Flushes what's outstanding; false if anything failed to reach the disk
+  {
+    DEBUG_SIMPLE;
+    std::shared_ptr<journal_state> j;
+    {
+      GUARD;
+      j.swap(m_journal);
+    }
+    return !j || j->log.sync();
+  };
 
-      if (need_erase != *this)
-      {
-        if (need_erase != map_real_end())
-        {
-          map_erase(need_erase);
-          return *this;
-        }
-      }
-     
-      return last;
-    };
+  bool sync()	// True straight away without a journal
+  {
+    DEBUG_SIMPLE;
+    std::shared_ptr<journal_state> j;
+    {
+      GUARD;
+      j = m_journal;
+    }
+    return !j || j->log.sync();
+  };
 
-    void decrement_forward_then_backward_core(const T& last)
+  // Writes a checkpoint of the map exactly as it was at the moment of the
+  // call, from a background thread, while everything else carries on.
+  // Writers keep the old version of anything they change that the dump
+  // hasn't reached yet (only the first change per key, and only until the
+  // dump passes it), and the dump takes the lock a block at a time, merging
+  // those in.  Values changed in place through an iterator, at() or
+  // operator[] aren't seen, as with the journal.  The file goes in place
+  // as save() does, and with a journal the log's moved aside to path.old at
+  // the cut and deleted once the checkpoint's safe.  One at a time; the
+  // future's false if one was already running or anything failed.  Dropping
+  // the future doesn't wait for the write, but the map's destructor does.
+  std::future<bool> checkpoint_async(const std::string& path, const serial_format format = serial_format::fixed)
+  {
+    DEBUG_SIMPLE;
+    std::shared_ptr<cut_state> cut = std::make_shared<cut_state>(m_map->key_comp());
+    std::shared_ptr<journal_state> j;
     {
-      DEBUG_FIRST;
-      decrement_forward_core(last);
-      if (*this == (Reversed ? map_real_end() : map_real_begin()))
+      GUARD;
+      if (m_cut)
       {
-        if (Reversed || (*this)->second._erase_when_unused)
+        std::promise<bool> busy;
+        busy.set_value(false);
+        return busy.get_future();
+      }
+      m_cut = cut;
+      m_cuts.push_back(cut.get());
+      j = m_journal;
+      if (j)	// If a path.old is still there from a checkpoint that failed, this one covers it too
+        j->log.rotate(j->path + ".old");
+    }
+    std::shared_ptr<std::promise<bool>> done = std::make_shared<std::promise<bool>>();
+    std::future<bool> ret = done->get_future();
+    std::thread worker([this, cut, j, path, format, done]() { done->set_value(finish_checkpoint(*cut, j, path, format)); });
+    {
+      GUARD;	// The last one's cleared m_cut, so it's at most renaming the file
+      worker.swap(m_checkpointer);
+    }
+    if (worker.joinable())
+      worker.join();
+    return ret;
+  };
+
+  bool checkpoint(const std::string& path, const serial_format format = serial_format::fixed)
+    { DEBUG_SIMPLE; return checkpoint_async(path, format).get(); };
+
+  // Splits the map into nparts key ranges of about the same size and dumps
+  // each into its own file in dir (part-00000.dump and on, each one
+  // loadable on its own), one thread per part.  The split is found by a
+  // walk that takes the lock a block at a time, and each part starts as
+  // soon as its end is known.  Ranges are split at keys, not elements, so
+  // whatever's erased or added meanwhile, every key lands in exactly one
+  // part.  The workers copy a block out under the lock and encode and
+  // write it after, so that's the only part they take turns on.  Like
+  // serialize(), not one consistent cut.  Files go in place as save()'s
+  // do; false if any part failed.
+  bool export_partitioned(const std::string& dir, const size_t nparts, const serial_format format = serial_format::fixed) const
+  {
+    DEBUG_SIMPLE;
+    if (!nparts)
+      return false;
+    const bool compact = (format == serial_format::compact);
+    std::vector<std::future<bool>> parts;
+    auto launch = [&](const std::shared_ptr<key_type>& first, const std::shared_ptr<key_type>& stop, const bool empty) {
+      char name[32];
+      snprintf(name, sizeof(name), "/part-%05u.dump", unsigned(parts.size()));
+      const std::string path = dir + name;
+      parts.push_back(std::async(std::launch::async, [this, path, first, stop, empty, compact]() {
+        const std::string temporary = path + ".tmp";
+        bool ok;
         {
-          T::operator=(last);
-          if ((iteration == ForwardSameThenBackward) && (!(*this)->second._erase_when_unused))
-            return;
-          increment_forward_core(last);
+          std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+          ok = out && write_range(out, first.get(), stop.get(), empty, compact) && out.flush();
         }
-      }
+        return ok && durable_rename(temporary, path);
+      }));
     };
-    
-    void increment_forward_then_backward_core(const T& last)
+
+    std::shared_ptr<key_type> from;	// Null for the start
+    std::unique_ptr<key_type> walked;	// The last key counted
+    size_t step, seen = 0;
     {
-      DEBUG_FIRST;
-      increment_forward_core(last);
-      auto endpoint = map_real_end();
-      if (Reversed)
-        --endpoint;
-      if (*this == endpoint)
+      GUARD;
+      step = std::max<size_t>(m_map->size() / nparts, 1);
+    }
+    for (bool done = false; !done && (parts.size() + 1 < nparts); )
+    {
+      std::shared_ptr<key_type> boundary;
       {
-        if ((!Reversed) || (*this)->second._erase_when_unused)
+        GUARD;
+        auto iter = walked ? m_map->upper_bound(*walked) : m_map->begin();
+        const key_type* last = nullptr;
+        for (uint32_t examined = 0; (iter != m_map->end()) && (examined < serial_block_size); ++examined)
         {
-          T::operator=(last);
-          if ((iteration == ForwardSameThenBackward) && (!(*this)->second._erase_when_unused))
-            return;
-          decrement_forward_core(last);
+          const bool boundary_here = !iter->second._erase_when_unused && (seen++ == (parts.size() + 1) * step);
+          if (boundary_here)
+            boundary = std::make_shared<key_type>(iter->first);
+          last = &iter->first;
+          ++iter;
+          if (boundary_here)
+            break;
         }
+        done = (iter == m_map->end());
+        if (last)
+          walked.reset(new key_type(*last));
       }
-    };
-    
-    void decrement_even_erased_linear_core(const T& last)
-    {
-      DEBUG_FIRST;
-      if (*this == map_real_begin())
+      if (boundary)
       {
-        if (Reversed)
-          T::operator=(map_real_end());
-        return;
+        launch(from, boundary, false);
+        from = boundary;
       }
-      T::operator--();
-    };
+    }
+    launch(from, nullptr, false);
+    while (parts.size() < nparts)
+      launch(nullptr, nullptr, true);
+
+    bool ok = true;
+    for (auto& i : parts)
+      ok = i.get() && ok;
+    return ok;
+  };
 
-    void increment_even_erased_linear_core(const T& last)
+  void cleanup() noexcept
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    expire_prelocked();
+    rebuild_filter_prelocked();
+    for (auto iter = m_map->begin(); iter != m_map->end(); )
     {
-      DEBUG_FIRST;
-      if (*this == map_real_end())
+      if ((iter->second._erase_when_unused) && (!iter->second._reference_count))
       {
-        if (Reversed)
-          T::operator=(map_real_begin());
-        return;
-      }        
-      T::operator++();
-    };
+        note_erase_prelocked(*iter);
+        iter = m_map->erase(iter);
+      }
+      else
+        ++iter;
+    }
+  };
 
-    void decrement_even_erased_circular_core(const T& last)
+#if __cplusplus >= 201703L
+  // Moving elements between maps without reallocating them (C++17 and up,
+  // since it needs std::map::extract).  Nodes that no iterator is pinning are
+  // relinked as-is.  A pinned node can't leave - its iterators have to keep
+  // working - so it's copied instead, and the original flagged for erasure.
+  typedef typename map_pointer_type::element_type::node_type node_type;
+
+  node_type extract(const key_type& k)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    base_iterator iter;
+    if (!find_live_prelocked(k, iter))
+      return node_type();
+    note_erase_prelocked(*iter);
+    if (!iter->second._reference_count)
+      return m_map->extract(iter);
+    typename map_pointer_type::element_type tmp(m_map->key_comp());
+    tmp.emplace(iter->first, static_cast<const mapped_type&>(iter->second));
+    iter->second._erase_when_unused = true;
+    return tmp.extract(tmp.begin());
+  };
+
+  // If the key's already present (and not flagged for erasure) nothing
+  // happens, and the node stays in nh.
+  std::pair<iterator, bool> insert(node_type&& nh)
+  {
+    DEBUG_SIMPLE;
+    GUARD;
+    if (nh.empty())
+      return std::make_pair(iterator(m_map->end(), m_map, m_lock), false);
+    base_iterator iter;
+    if (find_live_prelocked(nh.key(), iter))
+      return std::make_pair(iterator(iter, m_map, m_lock), false);
+    return std::make_pair(iterator(insert_node_prelocked(iter, std::move(nh)), m_map, m_lock), true);
+  };
+
+  // Moves everything from other whose key isn't already here.
+  void merge(map& other)
+  {
+    DEBUG_SIMPLE;
+    if (&other == this)
+      return;
+    GUARD_PAIR(*this, other);
+    base_iterator hint = m_map->begin();
+    for (auto iter = other.m_map->begin(); iter != other.m_map->end(); )
+      iter = take_prelocked(other, iter, hint);
+  };
+
+  // Moves every element with a key of k or more out into a new map.
+  map split(const key_type& k)
+  {
+    DEBUG_SIMPLE;
+    map ret(m_map->key_comp());
+    GUARD_PAIR(*this, ret);
+    base_iterator hint = ret.m_map->end();
+    for (auto iter = m_map->lower_bound(k); iter != m_map->end(); )
+      iter = ret.take_prelocked(*this, iter, hint);
+    return ret;
+  };
+#endif
+
+  // Moves the element with key k from src to dst, with both maps locked
+  // throughout, so no other thread sees it in both or in neither.  Fails if
+  // src doesn't have k or dst already does.  The node itself is relinked
+  // where possible (C++17, and no iterator pinning it); otherwise the value
+  // is copied across and erased from src.
+  static bool move_entry(map& src, map& dst, const key_type& k)
+  {
+    DEBUG_SIMPLE;
+    GUARD_PAIR(src, dst);
+    base_iterator iter, position;
+    if (!src.find_live_prelocked(k, iter))
+      return false;
+    if (&src == &dst)
+      return true;
+    if (dst.find_live_prelocked(k, position))
+      return false;
+    src.note_erase_prelocked(*iter);
+#if __cplusplus >= 201703L
+    if (!iter->second._reference_count)
     {
-      DEBUG_FIRST;
-      if (*this == map_real_begin())
-        T::operator=(map_real_end());
-      T::operator--();
-    };
+      dst.insert_node_prelocked(position, src.m_map->extract(iter));
+      return true;
+    }
+#endif
+    dst.place_prelocked(position, k, static_cast<const mapped_type&>(iter->second));
+    src.erase_prelocked(iter);
+    return true;
+  };
 
-    void increment_even_erased_circular_core(const T& last)
+  // Single-lookup read-modify-write.  Each of these takes the lock once and
+  // descends the tree once, and runs the function on the value in place while
+  // the lock is held - so keep it short.  An element that's been flagged for
+  // erasure counts as absent; if it's still pinned by an iterator it gets
+  // brought back to life with the new value rather than a second copy being
+  // made.  The plain versions return an iterator (with a bool that's true if
+  // the key was newly added); the _fast versions skip building the iterator.
+  template <class F> std::pair<iterator, bool> upsert(const key_type& k, F fn)	// fn(safe_mapped_type&), default-constructing first if absent
+    { DEBUG_SIMPLE; GUARD; auto ret = upsert_prelocked(k, fn); return std::make_pair(iterator(ret.first, m_map, m_lock), ret.second); };
+  template <class F> bool upsert_fast(const key_type& k, F fn)
+    { DEBUG_SIMPLE; GUARD; return upsert_prelocked(k, fn).second; };
+  template <class F> std::pair<iterator, bool> compute_if_absent(const key_type& k, F factory)	// factory() gives the value, only called if absent
+    { DEBUG_SIMPLE; GUARD; auto ret = compute_if_absent_prelocked(k, factory); return std::make_pair(iterator(ret.first, m_map, m_lock), ret.second); };
+  template <class F> bool compute_if_absent_fast(const key_type& k, F factory)
+    { DEBUG_SIMPLE; GUARD; return compute_if_absent_prelocked(k, factory).second; };
+  template <class F> iterator update_if_present(const key_type& k, F fn)	// fn(safe_mapped_type&), only called if present; returns end() if not
+    { DEBUG_SIMPLE; GUARD; return iterator(update_if_present_prelocked(k, fn), m_map, m_lock); };
+  template <class F> bool update_if_present_fast(const key_type& k, F fn)
+    { DEBUG_SIMPLE; GUARD; return update_if_present_prelocked(k, fn) != m_map->end(); };
+  
+  map_pointer_type m_map;
+  lock_pointer_type m_lock;
+  
+protected:
+
+  std::vector<std::shared_ptr<feed_type>> m_feeds;
+
+  struct journal_state	// Only allocated by enable_journal()
+  {
+    journal_state(const int fd, const std::string& p) :
+      path(p),
+      log(fd, p)
+      {};
+
+    std::string path;
+    journal log;
+    serial_writer record;	// Scratch space for the record being built, under the lock
+  };
+  std::shared_ptr<journal_state> m_journal;
+
+  struct cut_state	// For checkpoint_async() and snapshot(), the map as it was at the cut
+  {
+    explicit cut_state(const Compare& comp) :
+      before(comp)
+      {};
+
+    std::unique_ptr<key_type> passed;	// Keys up to here have been written
+    std::map<key_type, std::unique_ptr<mapped_type>, Compare> before;	// Keys past that changed since, as they were (null if absent)
+  };
+  std::shared_ptr<cut_state> m_cut;	// The running checkpoint's
+  mutable std::vector<cut_state*> m_cuts;	// Every cut still being read, the checkpoint's included
+  std::thread m_checkpointer;	// The last checkpoint's writer, joined by the next one or ~map()
+
+  // Call before k changes (with its value), or after it's added (without).
+  void remember_prelocked(const key_type& k, const safe_mapped_type* v)
+  {
+    for (cut_state* cut : m_cuts)
     {
-      DEBUG_FIRST;
-      if (*this == map_real_end())
-        T::operator=(map_real_begin());
-      else
-      {
-        T::operator++();
-        if (*this == map_real_end())
-          T::operator=(map_real_begin());
-      }
-    };
+      if (cut->passed && !m_map->key_comp()(*cut->passed, k))
+        continue;
+      auto iter = cut->before.lower_bound(k);
+      if ((iter != cut->before.end()) && !m_map->key_comp()(k, iter->first))
+        continue;	// Only the first change counts
+      cut->before.emplace_hint(iter, k, std::unique_ptr<mapped_type>(v ? new mapped_type(static_cast<const mapped_type&>(*v)) : nullptr));
+    }
+  };
 
-    void decrement_forward_core(const T& last)
+  void forget_cut_prelocked(const cut_state* cut) const
+  {
+    auto iter = std::find(m_cuts.begin(), m_cuts.end(), cut);
+    if (iter != m_cuts.end())
+      m_cuts.erase(iter);
+  };
+
+  // One block of a cut, under the lock: calls f(key, value) in key order
+  // for each entry the map had at the cut, merging the live elements with
+  // the old versions kept in cut.before, and moves cut.passed on.  False
+  // once it's reached the end.
+  template <class F> bool cut_block_prelocked(cut_state& cut, F f) const
+  {
+    const auto& comp = m_map->key_comp();
+    auto iter = cut.passed ? m_map->upper_bound(*cut.passed) : m_map->begin();
+    auto kept = cut.passed ? cut.before.upper_bound(*cut.passed) : cut.before.begin();
+    const key_type* last = nullptr;
+    for (uint32_t examined = 0; examined < serial_block_size; ++examined)
     {
-      DEBUG_FIRST;
-      if (*this == map_real_begin())
+      const bool live_left = (iter != m_map->end()), kept_left = (kept != cut.before.end());
+      if (kept_left && (!live_left || !comp(iter->first, kept->first)))
       {
-        if (Reversed)
-          T::operator=(map_real_end());
-        return;
+        if (live_left && !comp(kept->first, iter->first))
+          ++iter;	// The kept version wins
+        if (kept->second)
+          f(kept->first, *kept->second);
+        last = &kept->first;
+        ++kept;
       }
-      do 
-        { DEBUG_FIRST; T::operator--(); }
-        while (((*this)->second._erase_when_unused) && (*this != map_real_begin()));
-      if (Reversed)
+      else if (live_left)
       {
-        if ((*this)->second._erase_when_unused)
-          T::operator=(map_real_end());
+        if (!iter->second._erase_when_unused)
+          f(iter->first, static_cast<const mapped_type&>(iter->second));
+        last = &iter->first;
+        ++iter;
       }
-    };
+      else
+        break;
+    }
+    const bool more = (iter != m_map->end()) || (kept != cut.before.end());
+    if (last)
+      cut.passed.reset(new key_type(*last));
+    cut.before.erase(cut.before.begin(), kept);
+    return more;
+  };
 
-    void increment_forward_core(const T& last)
+  // checkpoint_async()'s background half.
+  bool finish_checkpoint(cut_state& cut, const std::shared_ptr<journal_state>& j, const std::string& path, const serial_format format)
+  {
+    const std::string temporary = path + ".tmp";
+    bool ok;
     {
-      DEBUG_FIRST;
-      if (*this == map_real_end())
-      {
-        if (Reversed)
-          T::operator=(map_real_begin());
-        else
-          return;
-      }
-      else
-        T::operator++();
-      while ((*this != map_real_end()) && ((*this)->second._erase_when_unused))
-        { DEBUG_FIRST; T::operator++(); } 
-      if ((Reversed) && (*this == map_real_end()))
-        T::operator--();
-    };
+      std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+      ok = out && write_cut(out, cut, format == serial_format::compact) && out.flush();
+    }
+    {
+      GUARD;
+      forget_cut_prelocked(m_cut.get());
+      m_cut.reset();
+    }
+    if (!ok || !durable_rename(temporary, path))
+      return false;
+    if (!j)
+      return true;
+    const std::string retired = j->path + ".old";
+    return (!unlink(retired.c_str()) || (errno == ENOENT)) && sync_path(parent_directory(retired), true);
+  };
 
-    void decrement_active_circular_core(const T& last)
+  // Like serialize(), but of the map at the cut: a block at a time, merging
+  // the live elements with the old versions kept in cut.before.
+  bool write_cut(std::ostream& out, cut_state& cut, const bool compact)
+  {
+    serial_writer writer(out);
+    writer.put(serial_magic(compact), serial_magic_size);
+    for (bool more = true; more; )
     {
-      DEBUG_FIRST;
-      if (*this == map_real_begin())
+      const size_t header = writer.size();
+      writer.put_u32(0);
+      writer.put_u32(0);
+      uint32_t count = 0;
       {
-        DEBUG_FIRST;
-        T::operator=(map_real_end());
-        T::operator--();
+        GUARD;
+        const key_type* previous = nullptr;
+        more = cut_block_prelocked(cut, [&](const key_type& k, const mapped_type& v) {
+          write_record(writer, compact, k, v, previous);
+          previous = &k;
+          ++count;
+        });
       }
-      else
+      if (count)
       {
-        if (*this == map_real_end())
-          T::operator--();
-        while (((*this)->second._erase_when_unused) && (*this != map_real_begin()))
-          { DEBUG_FIRST; T::operator--(); }
-        if ((*this)->second._erase_when_unused)
-        {
-          DEBUG_FIRST;
-          T::operator=(map_real_end());
-          if (*this == last)
-            return;
-          T::operator--();
-        }
+        writer.patch_u32(header, count);
+        writer.patch_u32(header + 4, writer.size() - header - 8);
       }
-      if ((*this)->second._erase_when_unused)
+      else if (more)
+        writer.rewind(header);	// Nothing live in this stretch; a zero block would end the dump
+      if (count && !more)
       {
-        while ((*this != last) && ((*this)->second._erase_when_unused))
-          { DEBUG_FIRST; T::operator--(); }
+        writer.put_u32(0);
+        writer.put_u32(0);
       }
-      if ((*this)->second._erase_when_unused)
-        T::operator=(map_real_end());
-    };
+      if (!writer.flush())
+        return false;
+    }
+    return true;
+  };
+  static const char journal_put = 1;
+  static const char journal_erase = 2;
 
-    void increment_active_circular_core(const T& last)
-    {
-      DEBUG_FIRST;
-      if (*this == map_real_end())
-        T::operator=(map_real_begin());
-      else
-        T::operator++();
-      while ((*this != map_real_end()) && ((*this)->second._erase_when_unused))
-        { DEBUG_FIRST; T::operator++(); } 
-      if ((*this == map_real_end()) && (*this != last))
-      {
-        T::operator=(map_real_begin());
-        while ((*this != last) && ((*this)->second._erase_when_unused))
-          { DEBUG_FIRST; T::operator++(); } 
-        if ((*this)->second._erase_when_unused)
-          T::operator=(map_real_end());
-      }
-    };
+  // Records are a length, a checksum, then the operation, the key and, for
+  // a put, the value.  (Maps that can't be serialized never have a journal.)
+  typedef std::integral_constant<bool, is_serializable<key_type>::value && is_serializable<mapped_type>::value> journalable;
 
-    void reference()
-    {
-      DEBUG_FIRST_SIMPLE;
-      ASSERT(m_map);
-      if (*this != map_real_end())
-        increment_reference();
-    };
-       
-    void dereference()
+  void journal_prelocked(const char op, const safe_value_type& v) { journal_prelocked(op, v, journalable()); };
+  void journal_prelocked(const char, const safe_value_type&, std::false_type) {};
+  void journal_prelocked(const char op, const safe_value_type& v, std::true_type)
+  {
+    serial_writer& record = m_journal->record;
+    record.clear();
+    record.put_u32(0);
+    record.put_u32(0);
+    record.put(&op, 1);
+    serial_codec<key_type>::write(record, v.first);
+    if (op == journal_put)
+      serial_codec<mapped_type>::write(record, static_cast<const mapped_type&>(v.second));
+    record.patch_u32(0, record.size() - 8);
+    record.patch_u32(4, journal::checksum(record.data() + 8, record.size() - 8));
+    m_journal->log.append(record.data(), record.size());
+  };
+
+  // Applies a journal file's records in order, stopping at the first torn
+  // or corrupt one (a crash mid-write) and cutting the file back to there.
+  // A missing file is an empty one; false if it couldn't be read or cut.
+  bool replay_prelocked(const std::string& path)
+  {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in)
+      return errno == ENOENT;
+    std::vector<char> bytes(size_t(in.tellg()));
+    in.seekg(0);
+    if (!in.read(bytes.data(), bytes.size()))
+      return false;
+    size_t position = 0;
+    for (uint32_t length, checksum; bytes.size() - position >= 8; position += 8 + length)
     {
-      DEBUG_FIRST_SIMPLE;
-      ASSERT(m_map);
-      if (*this != map_real_end())
+      serial_reader header(&bytes[position], 8);
+      header.get_u32(length);
+      header.get_u32(checksum);
+      if ((length > bytes.size() - position - 8) || (journal::checksum(&bytes[position + 8], length) != checksum))
+        break;
+      serial_reader record(&bytes[position + 8], length);
+      char op;
+      key_type k;
+      mapped_type v;
+      if (!record.get(&op, 1) || !serial_codec<key_type>::read(record, k))
+        break;
+      base_iterator iter;
+      const bool live = find_live_prelocked(k, iter);
+      if (op == journal_put)
       {
-        guard_type guard(*m_lock);
-        decrement_reference();
-        if (!((*this)->second._reference_count) && ((*this)->second._erase_when_unused))
-          map_erase(*this);
-      }   
-    }; 
-    T delayed_dereference()
-    {
-      ASSERT(m_map);
-      ASSERT(!m_lock->try_lock());
-      DEBUG_FIRST;
-      if (*this != map_real_end())
+        if (!serial_codec<mapped_type>::read(record, v))
+          break;
+        if (live)
+        {
+          note_update_prelocked(*iter);
+          iter->second = std::move(v);
+          ++m_generation;
+        }
+        else
+          place_prelocked(iter, k, std::move(v));
+      }
+      else if (op == journal_erase)
       {
-        decrement_reference();
-        if (!((*this)->second._reference_count) && ((*this)->second._erase_when_unused))
-          return static_cast<T>(*this);
+        if (live)
+          erase_prelocked(iter);
       }
-      return map_real_end();    
-    }; 
+      else
+        break;
+    }
+    return (position == bytes.size()) || !truncate(path.c_str(), position);
+  };
 
-    void map_erase(T i) { ASSERT(m_map); DEBUG_FIRST; m_map->erase(i); };    
-    T map_real_begin() { ASSERT(m_map); return map_begin(Dummy<T>()); };
-    T map_real_end() { ASSERT(m_map); return map_end(Dummy<T>()); };
-    T map_begin() { ASSERT(m_map); return (Reversed ? map_rbegin(Dummy<T>()) : map_begin(Dummy<T>())); };
-    T map_end() { ASSERT(m_map); return (Reversed ? map_rend(Dummy<T>()) : map_end(Dummy<T>())); };
-    T map_safe_begin() { ASSERT(m_map); return (Reversed ? map_safe_rbegin(Dummy<T>()) : map_begin(Dummy<T>())); };
-    T map_safe_end() { ASSERT(m_map); return (Reversed ? map_safe_rend(Dummy<T>()) : map_end(Dummy<T>())); };
-    base_iterator map_begin(Dummy<base_iterator>) { return m_map->begin(); };
-    base_iterator map_end(Dummy<base_iterator>) { return m_map->end(); };
-    base_const_iterator map_begin(Dummy<base_const_iterator>) { return m_map->cbegin(); };
-    base_const_iterator map_end(Dummy<base_const_iterator>) { return m_map->cend(); };
-    base_iterator map_safe_rbegin(Dummy<base_iterator>) { return m_map->end(); };
-    base_iterator map_safe_rend(Dummy<base_iterator>) { auto iter = m_map->end(); if (m_map->size()) --iter; return iter; };
-    base_const_iterator map_safe_rbegin(Dummy<base_const_iterator>) { return m_map->cend(); };
-    base_const_iterator map_safe_rend(Dummy<base_const_iterator>) { auto iter = m_map->cend(); if (m_map->size()) --iter; return iter; };
-    base_iterator map_rbegin(Dummy<base_iterator>) { return m_map->end(); };
-    base_iterator map_rend(Dummy<base_iterator>) { auto iter = m_map->end(); --iter; return iter; };
-    base_const_iterator map_rbegin(Dummy<base_const_iterator>) { return m_map->cend(); };
-    base_const_iterator map_rend(Dummy<base_const_iterator>) { auto iter = m_map->cend(); --iter; return iter; };
+  struct ttl_state	// Only allocated once something has a TTL
+  {
+    ttl_state(const Compare& comp) :
+      wheel(ttl_clock()),
+      deadlines(comp)
+      {};
 
-    void decrement_reference()
-    {
-      DEBUG_REFCOUNT;
-      --const_cast<std::atomic<int>&>((*this)->second._reference_count);
-      ASSERT((*this)->second._reference_count >= 0);
-    };
+    timer_wheel<key_type> wheel;
+    std::map<key_type, uint64_t, Compare> deadlines;	// The wheel may hold stale timers; these are the live ones
+  };
+  std::shared_ptr<ttl_state> m_ttl;
 
-    void increment_reference()
-    {
-      DEBUG_REFCOUNT;
-      ++const_cast<std::atomic<int>&>((*this)->second._reference_count);
-    };
+  static uint64_t ttl_clock()	// Milliseconds
+    { return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); };
 
+  void set_ttl_prelocked(const key_type& k, std::chrono::milliseconds ttl)
+  {
+    if (!m_ttl)
+      m_ttl.reset(new ttl_state(m_map->key_comp()));
+    const uint64_t deadline = ttl_clock() + std::max<int64_t>(ttl.count(), 0);
+    auto ret = m_ttl->deadlines.emplace(k, deadline);
+    if (!ret.second)
+    {
+      ret.first->second = deadline;
+      m_ttl->wheel.cancel();	// The timer for the old deadline
+    }
+    m_ttl->wheel.schedule(k, deadline);
   };
 
-  //////////////////////////////////////////
-  // Main portion of "map" begins here.
-  //////////////////////////////////////////
-  
-  typedef iterator_base<base_iterator, false>		iterator;
-  typedef iterator_base<base_const_iterator, false>	const_iterator;
-  typedef iterator_base<base_iterator, true>		reverse_iterator;
-  typedef iterator_base<base_const_iterator, true>	const_reverse_iterator;
-
-  explicit map(const Compare& comp = Compare(), const Allocator& alloc = Allocator()) : 
-    m_map(new std::map<key_type, safe_mapped_type>(comp, alloc)),
-    m_lock(new mutex_type())
-    { DEBUG_SIMPLE; };
+  size_type expire_prelocked()
+  {
+    if (!m_ttl)
+      return 0;
+    size_type ret = 0;
+    m_ttl->wheel.advance(ttl_clock(), [&](const key_type& k, uint64_t deadline) {
+      auto d = m_ttl->deadlines.find(k);
+      if ((d == m_ttl->deadlines.end()) || (d->second != deadline))
+        return false;
+      m_ttl->deadlines.erase(d);	// First, so that erasing doesn't cancel() it
+      base_iterator iter;
+      if (find_live_prelocked(k, iter))
+      {
+        erase_prelocked(iter);
+        ++ret;
+      }
+      return true;
+    });
+    return ret;
+  };
 
-  explicit map(const Allocator& alloc) : 
-    m_map(new std::map<key_type, safe_mapped_type>(alloc)),
-    m_lock(new mutex_type())
-    { DEBUG_SIMPLE; };
+  void publish_prelocked(change_kind kind, const safe_value_type& v)
+  {
+    for (auto& i : m_feeds)
+      i->push(kind, v.first, v.second);
+  };
 
-  map(const std::map<key_type, safe_mapped_type>& other) : 
-    m_map(new std::map<key_type, safe_mapped_type>(other)),
-    m_lock(new mutex_type())
-    { DEBUG_SIMPLE; };
-  
-  template<class InputIterator> 
-  map(InputIterator first, InputIterator last, const Compare& comp = Compare(), const Allocator& alloc = Allocator()) :
-    m_map(new std::map<key_type, safe_mapped_type>(first, last, comp, alloc)),
-    m_lock(new mutex_type())
-    { DEBUG_SIMPLE; };
+  // Call just before an element is erased or flagged.  Erasing a flagged
+  // element is the reclaim; don't call it to flag one again.
+  void note_erase_prelocked(const safe_value_type& v)
+  {
+    ++m_generation;
+    if (m_ttl && !v.second._erase_when_unused && m_ttl->deadlines.erase(v.first))
+      m_ttl->wheel.cancel();
+    if (m_journal && !v.second._erase_when_unused)
+      journal_prelocked(journal_erase, v);
+    if (!m_cuts.empty() && !v.second._erase_when_unused)
+      remember_prelocked(v.first, &v.second);
+    if (m_feeds.empty())
+      return;
+    if (!v.second._erase_when_unused)
+      publish_prelocked(change_kind::erased, v);
+    else if (!v.second._reference_count)
+      publish_prelocked(change_kind::reclaimed, v);
+  };
 
-  template<class InputIterator>
-  map(InputIterator first, InputIterator last, const Allocator& alloc) : 
-    m_map(new std::map<key_type, safe_mapped_type>(first, last, alloc)),
-    m_lock(new mutex_type())
-    { DEBUG_SIMPLE; };
+  // Flags an element for erasure without touching the tree.  One that's
+  // already flagged stays as it is, so nothing is reported for it.
+  void flag_prelocked(safe_value_type& v)
+  {
+    if (v.second._erase_when_unused)
+      return;
+    note_erase_prelocked(v);
+    v.second._erase_when_unused = true;
+  };
 
-  map(const std::map<key_type, safe_mapped_type>& other, const Allocator& alloc) : 
-    m_map(new std::map<key_type, safe_mapped_type>(other, alloc)),
-    m_lock(new mutex_type())
-    { DEBUG_SIMPLE; };
+  // Call just before an element's value is changed in place.
+  void note_update_prelocked(const safe_value_type& v)
+  {
+    if (!m_cuts.empty())
+      remember_prelocked(v.first, &v.second);
+  };
 
-  map(const std::map<key_type, safe_mapped_type>&& other) : 
-    m_map(new std::map<key_type, safe_mapped_type>(other)),
-    m_lock(new mutex_type())
-    { DEBUG_SIMPLE; };
+  // Call just after an element is inserted.  logged is false for one that
+  // operator[] made: its default value isn't what the caller's about to
+  // write through the reference, so it's left out of the journal.
+  void note_insert_prelocked(const std::pair<base_iterator, bool>& ret, const bool logged = true)
+  {
+    if (!ret.second)
+      return;
+    ++m_generation;
+    if (filter_type* filter = m_filter.load())
+    {
+      if (m_map->size() > 2 * filter->capacity())
+        rebuild_filter_prelocked();
+      else
+        filter->add(ret.first->first);
+    }
+    if (!m_feeds.empty())
+      publish_prelocked(change_kind::inserted, *ret.first);
+    if (m_journal && logged)
+      journal_prelocked(journal_put, *ret.first);
+    if (!m_cuts.empty())
+      remember_prelocked(ret.first->first, nullptr);
+    if (m_clock)
+      evict_prelocked(ret.first);
+  };
 
-  map(const std::map<key_type, safe_mapped_type>&& other, const Allocator& alloc) : 
-    m_map(new std::map<key_type, safe_mapped_type>(other, alloc)),
-    m_lock(new mutex_type())
-    { DEBUG_SIMPLE; };
+  // A flagged element counts as gone - handing it to an iterator would skip
+  // on to the next key instead.
+  base_iterator find_prelocked(const key_type& k) const
+  {
+    auto iter = m_map->find(k);
+    if ((iter != m_map->end()) && iter->second._erase_when_unused)
+      return m_map->end();
+    return touch(iter);
+  };
 
-  map(const safe::map<key_type, mapped_type>& other, const Compare& comp = Compare(), const Allocator& alloc = Allocator()) :
-    m_map(new std::map<key_type, safe_mapped_type>(comp, alloc)),
-    m_lock(new mutex_type())
-    { DEBUG_SIMPLE; operator=(other); };
-  
-  map(const safe::map<key_type, mapped_type>& other, const Allocator& alloc) : 
-    m_map(new std::map<key_type, safe_mapped_type>(alloc)),
-    m_lock(new mutex_type())
-    { DEBUG_SIMPLE; operator=(other); };
+  // Lookup hits: set the CLOCK bit and bump the admission sketch.
+  base_iterator touch(base_iterator iter) const
+  {
+    if (m_clock && (iter != m_map->end()))
+      touch(iter->first, iter->second);
+    return iter;
+  };
+  safe_mapped_type& touch(const key_type& k, safe_mapped_type& v) const
+  {
+    if (m_clock)
+    {
+      v._accessed = true;
+      if (m_sketch)
+        m_sketch->record(k);
+    }
+    return v;
+  };
 
-  map(safe::map<key_type, mapped_type>&& other, const Compare& comp = Compare(), const Allocator& alloc = Allocator()) : 
-    m_map(new std::map<key_type, safe_mapped_type>(comp, alloc)),
-    m_lock(new mutex_type())
-    { DEBUG_SIMPLE; operator=(other); };
+  std::shared_ptr<frequency_sketch<key_type>> m_sketch;
 
-  map(safe::map<key_type, mapped_type>&& other, const Allocator& alloc) : 
-    m_map(new std::map<key_type, safe_mapped_type>(alloc)),
-    m_lock(new mutex_type())
-    { DEBUG_SIMPLE; operator=(other); };
+  copyable_atomic<uint64_t> m_generation;	// Bumped by every insert and erase
 
-  map(const std::map<key_type, mapped_type>& other, const Compare& comp = Compare(), const Allocator& alloc = Allocator()) :
-    m_map(new std::map<key_type, safe_mapped_type>(comp, alloc)),
-    m_lock(new mutex_type())
-    { DEBUG_SIMPLE; operator=(other); };
-  
-  map(const std::map<key_type, mapped_type>& other, const Allocator& alloc) : 
-    m_map(new std::map<key_type, safe_mapped_type>(alloc)),
-    m_lock(new mutex_type())
-    { DEBUG_SIMPLE; operator=(other); };
+  static const size_t cache_size = 8;
+  struct cache_entry
+  {
+    const void* map;
+    uint64_t generation;
+    iterator iter;
+  };
+  static std::vector<cache_entry>& lookup_cache()
+  {
+    static thread_local std::vector<cache_entry> cache;
+    if (!cache.capacity())
+      cache.reserve(cache_size);
+    return cache;
+  };
+  static size_t& cache_victim()
+  {
+    static thread_local size_t victim = 0;
+    return victim;
+  };
 
-  map(std::initializer_list<value_type> init, const Compare& comp = Compare(), const Allocator& alloc = Allocator()) : 
-    m_map(new std::map<key_type, safe_mapped_type>(comp, alloc)),
-    m_lock(new mutex_type())
-    { DEBUG_SIMPLE; operator=(init); };
+  typedef bloom_filter<key_type> filter_type;
+  copyable_atomic<filter_type*> m_filter;	// Read without the lock
+  std::shared_ptr<std::vector<std::shared_ptr<filter_type>>> m_filter_storage;	// The current filter, and any it replaced that lock-free readers might still be in
 
-  map(std::initializer_list<value_type> init, const Allocator& alloc) : 
-    m_map(new std::map<key_type, safe_mapped_type>(alloc)),
-    m_lock(new mutex_type())
-    { DEBUG_SIMPLE; operator=(init); };
+  bool filtered_out(const key_type& k) const
+  {
+    const filter_type* filter = m_filter.load();
+    return filter && !filter->might_contain(k);
+  };
+  void filter_or_throw(const key_type& k) const
+  {
+    if (filtered_out(k))
+      throw std::out_of_range("map::at");
+  };
 
-  ~map()
-    { DEBUG_SIMPLE; };
- 
-  safe_mapped_type& at(const key_type& k)
-    { DEBUG_SIMPLE; GUARD; return m_map->at(k); };
-  const safe_mapped_type& at(const key_type& k) const
-    { DEBUG_SIMPLE; GUARD; return m_map->at(k); };
-  iterator begin() noexcept
-    { DEBUG_SIMPLE; GUARD; return iterator(m_map->begin(), m_map, m_lock); };
-  const_iterator cbegin() const noexcept
-    { DEBUG_SIMPLE; GUARD; return const_iterator(m_map->cbegin(), m_map, m_lock); };
-  const_iterator cend() const noexcept
-    { DEBUG_SIMPLE; GUARD; return const_iterator(m_map->cend(), m_map, m_lock); };
-  size_type count(const key_type& k) const
-    { DEBUG_SIMPLE; GUARD_COUNT; return m_map->count(k); };
-  const_reverse_iterator crbegin() const noexcept
+  void rebuild_filter_prelocked()
   {
-    DEBUG_SIMPLE;
-    GUARD;
-    auto tmp = m_map->cend();
-    if (m_map->size())
-       --tmp;
-    return const_reverse_iterator(std::move(tmp), m_map, m_lock);
+    filter_type* filter = m_filter.load();
+    if (!filter)
+      return;
+    if (m_map->size() <= filter->capacity())
+    {
+      filter->rebuild(m_map->begin(), m_map->end());
+      return;
+    }
+    m_filter_storage->push_back(std::make_shared<filter_type>(2 * m_map->size(), m_filter_storage->back()->hash_function()));
+    m_filter_storage->back()->rebuild(m_map->begin(), m_map->end());
+    m_filter.store(m_filter_storage->back().get());
   };
-  const_reverse_iterator crend() const noexcept
-    { DEBUG_SIMPLE; GUARD; return const_reverse_iterator(m_map->cend(), m_map, m_lock); };
-  template <class... Args> std::pair<iterator, bool> emplace(Args&&... args)
-    { DEBUG_SIMPLE; GUARD; auto ret = m_map->emplace(std::forward<Args>(args)...); return std::make_pair(iterator(ret.first, m_map, m_lock), ret.second); };
-  template <class... Args> iterator emplace_hint(const_iterator position, Args&&... args)
-    { DEBUG_SIMPLE; GUARD; return iterator(m_map->emplace_hint(position, std::forward<Args>(args)...), m_map, m_lock); };
-  bool empty() const noexcept { return m_map->empty(); };
-  iterator end() noexcept
-    { DEBUG_SIMPLE; GUARD; return iterator(m_map->end(), m_map, m_lock); };
-  const_iterator end() const noexcept
-    { DEBUG_SIMPLE; GUARD; return iterator(m_map->end(), m_map, m_lock); };
-  std::pair<const_iterator, const_iterator> equal_range(const key_type& k) const
-    { DEBUG_SIMPLE; GUARD; auto ret = m_map->equal_range(k); return std::make_pair(const_iterator(ret.first, m_map, m_lock), const_iterator(ret.second, m_map, m_lock)); };
-  std::pair<iterator, iterator> equal_range(const key_type& k)
-    { DEBUG_SIMPLE; GUARD; auto ret = m_map->equal_range(k); return std::make_pair(iterator(ret.first, m_map, m_lock), iterator(ret.second, m_map, m_lock)); };
-  iterator find(const key_type& k)
-    { DEBUG_SIMPLE; GUARD; return iterator(m_map->find(k), m_map, m_lock); };
-  const_iterator find(const key_type& k) const
-    { DEBUG_SIMPLE; GUARD; return const_iterator(m_map->find(k), m_map, m_lock); };
-  std::pair<iterator, bool> insert(const value_type& val)
-    { DEBUG_SIMPLE; GUARD; auto ret = m_map->insert(safe_value(val)); return std::make_pair(iterator(ret.first, m_map, m_lock), ret.second); };
-  std::pair<iterator, bool> insert(value_type&& val)
+
+  // emplace() and insert() go through here rather than straight to
+  // note_insert_prelocked(), so admission can turn a new key away.
+  void admit_prelocked(std::pair<base_iterator, bool>& ret)
   {
-    DEBUG_SIMPLE;
-    GUARD;
-    auto ret = m_map->insert(safe_value(val)); 
-    return std::make_pair(iterator(ret.first, m_map, m_lock), ret.second);
+    if (ret.second && m_sketch && m_clock && (m_map->size() > m_clock->capacity))
+    {
+      m_sketch->record(ret.first->first);
+      auto victim = clock_victim_prelocked(ret.first);
+      if ((victim != m_map->end()) && !victim->second._erase_when_unused &&
+          (m_sketch->estimate(ret.first->first) <= m_sketch->estimate(victim->first)))
+      {
+        if (ret.first->second._reference_count)	// Revived, and still pinned (before C++17)
+          ret.first->second._erase_when_unused = true;
+        else
+          m_map->erase(ret.first);
+        ret = std::make_pair(m_map->end(), false);
+        return;
+      }
+    }
+    note_insert_prelocked(ret);
   };
-  template <class P> std::pair<iterator, bool> insert(P&& val)
-    { DEBUG_SIMPLE; GUARD; auto ret = m_map->insert(safe_value(val)); return std::make_pair(iterator(ret.first, m_map, m_lock), ret.second); };
-  iterator insert(const_iterator position, const value_type& val)
-    { DEBUG_SIMPLE; GUARD; return iterator(m_map->insert(position, safe_value(val)), m_map, m_lock); };
-  template <class InputIterator> void insert(InputIterator first, InputIterator last)
+  void admit_prelocked(std::pair<base_iterator, bool>&& ret)
+    { admit_prelocked(ret); };
+
+  static const size_type node_bytes = sizeof(safe_value_type) + 4 * sizeof(void*);	// Roughly what a red-black tree node costs
+
+  struct clock_state
   {
-    DEBUG_SIMPLE;
-    GUARD; 
-    for (auto iter = first; iter != last; ++iter)
-      m_map->insert(*iter);
+    size_type capacity = 0;
+    bool has_hand = false;
+    key_type hand;	// Where the sweep carries on from
   };
-  template <class U, bool V> void insert(const iterator_base<U, V>& first, const iterator_base<U, V>& last)
+  std::shared_ptr<clock_state> m_clock;
+
+  // Evicts until the map's back within capacity, or there's nothing left that
+  // can go.  keep is never evicted (it's what was just inserted).
+  void evict_prelocked(base_iterator keep)
   {
-    DEBUG_SIMPLE;
-    ASSERT(first.m_map == last.m_map); 
-    GUARD; 
-    for (auto iter = first; iter != last; ++iter)
-      m_map->insert(*iter);
+    while ((m_map->size() > m_clock->capacity) && evict_one_prelocked(keep))
+      ;
   };
-  void insert(std::initializer_list<value_type> il)
+
+  bool evict_one_prelocked(base_iterator keep)
   {
-    DEBUG_SIMPLE;
-    GUARD;
-    for (auto & i : il)
-      m_map->insert(i);
+    auto iter = clock_victim_prelocked(keep);
+    if (iter == m_map->end())
+      return false;
+    note_erase_prelocked(*iter);
+    iter = m_map->erase(iter);
+    m_clock->has_hand = (iter != m_map->end());
+    if (m_clock->has_hand)
+      m_clock->hand = iter->first;
+    return true;
   };
-  key_compare key_comp() const { return m_map->key_comp(); };
-  iterator lower_bound(const key_type& k)
-    { DEBUG_SIMPLE; GUARD; return iterator(m_map->lower_bound(k), m_map, m_lock); };
-  const_iterator lower_bound(const key_type& k) const
-    { DEBUG_SIMPLE; GUARD; return const_iterator(m_map->lower_bound(k), m_map, m_lock); };
-  size_type max_size() const noexcept { return m_map->max_size(); };
-  map<key_type, mapped_type>& operator=(const map<key_type, mapped_type>& x)
+
+  // The element CLOCK would evict next, or end() if everything's pinned.  The
+  // hand is left on it, with the bits it passed cleared, so looking first and
+  // evicting afterwards walks the ring once, not twice.
+  base_iterator clock_victim_prelocked(base_iterator keep)
   {
-    DEBUG_SIMPLE;
-    GUARD;
-    GUARD_RHS(x);
-    clear_prelocked();
-    for (auto& i : *x.m_map)
+    auto iter = m_clock->has_hand ? m_map->lower_bound(m_clock->hand) : m_map->begin();
+    for (size_type steps = 2 * m_map->size() + 1; steps; --steps)	// Twice round clears every bit
     {
-      auto second = i.second;
-      if (!second._erase_when_unused)
+      if (iter == m_map->end())
+        iter = m_map->begin();
+      auto& v = iter->second;
+      if ((iter != keep) && !v._reference_count)
       {
-        second._reference_count = 0;
-        m_map->emplace(i.first, second); 
+        if (v._erase_when_unused || !v._accessed)
+        {
+          m_clock->has_hand = true;
+          m_clock->hand = iter->first;
+          return iter;
+        }
+        v._accessed = false;
       }
+      ++iter;
     }
-    return *this;
+    return m_map->end();
   };
-  map<key_type, mapped_type>& operator=(const std::map<key_type, mapped_type>& x)
+
+  void clear_prelocked() noexcept
   {
     DEBUG_SIMPLE;
-    GUARD;
-    clear_prelocked();
-    for (auto& i : x)
-      m_map->emplace(i.first, safe_mapped_type(i.second));
-    return *this;
+    for (auto iter = m_map->begin(); iter != m_map->end(); )
+    {
+      note_erase_prelocked(*iter);
+      if (!iter->second._reference_count)
+        iter = m_map->erase(iter);
+      else
+      {
+        iter->second._erase_when_unused = true;
+        ++iter;
+      }
+    }
   };
-  map<key_type, mapped_type>& operator=(map<key_type, mapped_type>&& x)
+  
+  template <class U, bool V> iterator_base<U, V>& erase_prelocked(iterator_base<U, V>& iter)
   {
-    DEBUG_SIMPLE;
-    GUARD; 
-    GUARD_RHS(x); 
-    clear_prelocked();	// Wish I could just call swap on the map and lock, but there's no way to make that work without a double dereference pointer setup, which would hurt performance.
-    for (auto& i : *x.m_map)
+    note_erase_prelocked(*iter);
+    if (!iter->second._reference_count)
+      iter = m_map->erase(iter);
+    else
+      iter->second._erase_when_unused = true;
+    return iter;
+  };
+
+  template <class U> U& erase_prelocked(U& iter)
+  {
+    note_erase_prelocked(*iter);
+    if (!iter->second._reference_count)
+      iter = m_map->erase(iter);
+    else
+      iter->second._erase_when_unused = true;
+    return iter;
+  };
+
+  // lower_bound(k), starting the search from hint.  If the answer is only a
+  // few steps away in either direction it's reached by walking; anything
+  // further starts over from the root, so this is never much worse than a
+  // plain lower_bound.
+  static const int finger_steps = 8;
+  template <class M, class I> static I lower_bound_near(M& m, I hint, const key_type& k)
+  {
+    const auto comp = m.key_comp();
+    if ((hint == m.end()) || !comp(hint->first, k))
     {
-      auto second = i.second;
-      if (!second._erase_when_unused)
+      for (int i = 0; (i < finger_steps) && (hint != m.begin()); ++i)
       {
-        second._reference_count = 0;
-        m_map->emplace(i.first, second); 
+        I previous = hint;
+        --previous;
+        if (comp(previous->first, k))
+          return hint;
+        hint = previous;
       }
+      if (hint == m.begin())
+        return hint;
     }
-    return *this;
+    else
+    {
+      for (int i = 0; (i < finger_steps) && (hint != m.end()); ++i, ++hint)
+        if (!comp(hint->first, k))
+          return hint;
+    }
+    return m.lower_bound(k);
   };
-  map<key_type, mapped_type>& operator=(std::map<key_type, mapped_type>&& x)
+
+  template <class InputIterator> size_type find_many_prelocked(InputIterator first, InputIterator last, std::vector<base_iterator>& hits) const
   {
-    DEBUG_SIMPLE;
-    GUARD;
-    clear_prelocked();
-    for (auto i = x.m_map->begin(); i != x.m_map->end(); ++i)
-      m_map->insert(*i); 
-    return *this;
+    const auto comp = m_map->key_comp();
+    size_type found = 0;
+    base_iterator hint = m_map->begin();
+    for (auto k = first; k != last; ++k)
+    {
+      hint = lower_bound_near(*m_map, hint, *k);
+      if ((hint != m_map->end()) && !comp(*k, hint->first) && !hint->second._erase_when_unused)
+      {
+        hits.push_back(hint);
+        ++found;
+      }
+      else
+        hits.push_back(m_map->end());
+    }
+    return found;
   };
-  map<key_type, mapped_type>& operator=(std::initializer_list<value_type> il)
+
+  // Builds the iterators only once there's room for all of them: if the vector
+  // had to grow, it would copy and destroy iterators, which would need the lock.
+  template <class InputIterator, class I> size_type find_many_helper(InputIterator first, InputIterator last, std::vector<I>& out) const
   {
-    DEBUG_SIMPLE;
     GUARD;
-    clear_prelocked();
-    for (auto& val : il)
-      m_map->insert(safe_value(val)); 
-    return *this;
+    std::vector<base_iterator> hits;
+    const size_type found = find_many_prelocked(first, last, hits);
+    out.reserve(out.size() + hits.size());
+    for (auto& i : hits)
+      out.push_back(I(i, m_map, m_lock));
+    return found;
   };
-  safe_mapped_type& operator[](const key_type& k)
-    { DEBUG_SIMPLE; GUARD; return m_map->operator[](k); };
-  safe_mapped_type& operator[](key_type&& k)
-    { DEBUG_SIMPLE; GUARD; return m_map->operator[](std::forward<key_type>(k)); };
-  reverse_iterator rbegin() noexcept
+
+  // Finds where k is or would go; true if it's there and not flagged for erasure.
+  bool find_live_prelocked(const key_type& k, base_iterator& iter)
   {
-    DEBUG_SIMPLE;
-    GUARD;
-    auto tmp = m_map->end();
-    if (m_map->size())
-       --tmp;
-    return reverse_iterator(std::move(tmp), m_map, m_lock);
+    iter = m_map->lower_bound(k);
+    return (iter != m_map->end()) && !m_map->key_comp()(k, iter->first) && !iter->second._erase_when_unused;
   };
-  const_reverse_iterator rbegin() const noexcept
+
+  template <class F> std::pair<base_iterator, bool> upsert_prelocked(const key_type& k, F& fn)
   {
-    DEBUG_SIMPLE;
-    GUARD;
-    auto tmp = m_map->end();
-    if (m_map->size())
-       --tmp;
-    return const_reverse_iterator(std::move(tmp), m_map, m_lock);
+    base_iterator iter;
+    const bool inserted = !find_live_prelocked(k, iter);
+    if (inserted)
+      iter = put_prelocked(iter, k, mapped_type());
+    else
+      note_update_prelocked(*iter);
+    fn(iter->second);
+    if (inserted)	// Reported and logged with the value fn() left
+    {
+      note_insert_prelocked(std::make_pair(iter, true));
+      return std::make_pair(iter, true);
+    }
+    if (!m_feeds.empty())
+      publish_prelocked(change_kind::updated, *iter);
+    if (m_journal)
+      journal_prelocked(journal_put, *iter);
+    return std::make_pair(iter, false);
   };
-  reverse_iterator rend() noexcept
-    { DEBUG_SIMPLE; GUARD; return reverse_iterator(m_map->end(), m_map, m_lock); };
-  const_reverse_iterator rend() const noexcept
-    { DEBUG_SIMPLE; GUARD; return const_reverse_iterator(m_map->rend(), m_map, m_lock); };
-  size_type size() const noexcept
-    { DEBUG_SIMPLE; GUARD_SIZE; return m_map->size(); };
-  void swap(map<key_type, mapped_type>& x)
+
+  template <class F> std::pair<base_iterator, bool> compute_if_absent_prelocked(const key_type& k, F& factory)
   {
-    DEBUG_SIMPLE;
-    GUARD;
-    GUARD_RHS(x);
-    std::map<key_type, safe_mapped_type> tmp;
-    for (auto iter = m_map->begin(); iter != m_map->end(); )
+    base_iterator iter;
+    if (find_live_prelocked(k, iter))
+      return std::make_pair(iter, false);
+    return std::make_pair(place_prelocked(iter, k, factory()), true);
+  };
+
+  template <class F> base_iterator update_if_present_prelocked(const key_type& k, F& fn)
+  {
+    base_iterator iter;
+    if (!find_live_prelocked(k, iter))
+      return m_map->end();
+    note_update_prelocked(*iter);
+    fn(iter->second);
+    if (!m_feeds.empty())
+      publish_prelocked(change_kind::updated, *iter);
+    if (m_journal)
+      journal_prelocked(journal_put, *iter);
+    return iter;
+  };
+
+  // deserialize(), from a stream or from bytes in memory.
+  bool deserialize(serial_reader& reader)
+  {
+    char magic[serial_magic_size];
+    if (!reader.get(magic, serial_magic_size))
+      return false;
+    const bool compact = !memcmp(magic, serial_magic(true), serial_magic_size);
+    if (!compact && memcmp(magic, serial_magic(false), serial_magic_size))
+      return false;
+    std::vector<std::pair<key_type, mapped_type>> block;
+    for (bool first = true; ; first = false)
     {
-      if (!iter->second._erase_when_unused)
+      uint32_t count, length;
+      if (!reader.get_u32(count) || !reader.get_u32(length))
+        return false;
+      block.clear();
+      block.reserve((count < serial_block_size) ? count : serial_block_size);	// No more than serialize() writes, whatever a bad header says
+      for (uint32_t i = 0; i < count; ++i)
       {
-        auto second = iter->second;
-        second._reference_count = 0;
-        tmp.emplace(iter->first, second);
-        if (!iter->second._reference_count)
+        block.emplace_back();
+        auto& record = block.back();
+        if (compact ? (!compact_codec<key_type>::read(reader, record.first, i ? &block[i - 1].first : nullptr) || !compact_codec<mapped_type>::read(reader, record.second))
+                    : (!serial_codec<key_type>::read(reader, record.first) || !serial_codec<mapped_type>::read(reader, record.second)))
+          return false;
+      }
+      GUARD;
+      if (first)
+        clear_prelocked();
+      if (!count)
+        return true;
+      load_sorted_prelocked(block.begin(), block.end());
+    }
+  };
+
+  // One part for export_partitioned(): a dump of the keys in [first, stop),
+  // where a null first is the start and a null stop the end; nothing at all
+  // if empty.  Carries on from the last key examined, as serialize() does.
+  bool write_range(std::ostream& out, const key_type* first, const key_type* stop, const bool empty, const bool compact) const
+  {
+    serial_writer writer(out);
+    writer.put(serial_magic(compact), serial_magic_size);
+    std::unique_ptr<key_type> last;	// The last key examined, to carry on from
+    std::vector<std::pair<key_type, mapped_type>> block;
+    for (bool more = !empty; more; )
+    {
+      {
+        GUARD;
+        auto iter = last ? m_map->upper_bound(*last) : (first ? m_map->lower_bound(*first) : m_map->begin());
+        const auto stop_at = stop ? m_map->lower_bound(*stop) : m_map->end();
+        if (first && stop && !m_map->key_comp()(*first, *stop))
+          iter = stop_at;
+        const key_type* examined = nullptr;
+        for (; (iter != stop_at) && (block.size() < serial_block_size); ++iter)
         {
-          iter = m_map->erase(iter);
-          continue;
+          if (!iter->second._erase_when_unused)
+            block.emplace_back(iter->first, static_cast<const mapped_type&>(iter->second));
+          examined = &iter->first;
         }
-        else
-          iter->second._erase_when_unused = true;
+        more = (iter != stop_at);
+        if (examined)
+          last.reset(new key_type(*examined));
       }
-      ++iter;
+      writer.put_u32(block.size());
+      const size_t header = writer.size();
+      writer.put_u32(0);
+      for (size_t i = 0; i < block.size(); ++i)
+        write_record(writer, compact, block[i].first, block[i].second, i ? &block[i - 1].first : nullptr);
+      writer.patch_u32(header, writer.size() - header - 4);
+      if (!block.empty() && !more)
+      {
+        writer.put_u32(0);
+        writer.put_u32(0);
+      }
+      block.clear();
+      if (!writer.flush())
+        return false;
     }
-    for (auto& i : *x.m_map)
+    if (empty)
     {
-      m_map->insert(i); 
-      i.second._reference_count = 0;
+      writer.put_u32(0);
+      writer.put_u32(0);
     }
-    for (auto& i : *x.m_map)
+    return writer.flush();
+  };
+
+  static void write_record(serial_writer& writer, const bool compact, const key_type& k, const mapped_type& v, const key_type* previous)
+  {
+    if (compact)
+    {
+      compact_codec<key_type>::write(writer, k, previous);
+      compact_codec<mapped_type>::write(writer, v);
+    }
+    else
+    {
+      serial_codec<key_type>::write(writer, k);
+      serial_codec<mapped_type>::write(writer, v);
+    }
+  };
+
+  static const uint32_t serial_block_size = 4096;
+  static const size_t serial_magic_size = 8;
+  static const char* serial_magic(const bool compact) { return compact ? "SAFEMAPC" : "SAFEMAP1"; };
+
+  // Adds [first, last), which should be in key order: each one's placed by
+  // walking on from the last rather than searching, so a whole sorted load
+  // is linear.  Out-of-order records still go in, just more slowly, and ones
+  // whose key's already live are skipped.
+  template <class InputIterator> void load_sorted_prelocked(InputIterator first, InputIterator last)
+  {
+    base_iterator hint = m_map->end();
+    for (; first != last; ++first)
     {
-      if (!i.second._erase_when_unused)
+      hint = lower_bound_near(*m_map, hint, first->first);
+      if ((hint != m_map->end()) && !m_map->key_comp()(first->first, hint->first) && !hint->second._erase_when_unused)
+        continue;
+      hint = put_prelocked(hint, first->first, std::move(first->second));
+      note_insert_prelocked(std::make_pair(hint, true));
+    }
+  };
+
+  // Moves src's live elements into this map, which must not already have
+  // any of their keys live.  Pinned elements are copied and left flagged.
+  void transfer_prelocked(map& src)
+  {
+    base_iterator position;
+    for (auto iter = src.m_map->begin(); iter != src.m_map->end(); )
+    {
+      if (iter->second._erase_when_unused)
       {
-        auto second = i.second;
-        second._reference_count = 0;
-        m_map->emplace(i.first, second); 
+        ++iter;
+        continue;
+      }
+      find_live_prelocked(iter->first, position);
+      place_prelocked(position, iter->first, static_cast<const mapped_type&>(iter->second));
+      src.note_erase_prelocked(*iter);
+      if (!iter->second._reference_count)
+        iter = src.m_map->erase(iter);
+      else
+      {
+        iter->second._erase_when_unused = true;
+        ++iter;
       }
     }
-    for (auto& i : tmp)
-      m_map->insert(i); 
   };
-  void swap(std::map<key_type, mapped_type>& x)
+
+  // Puts a value at the position found by find_live_prelocked(), in a new
+  // element.  A flagged one already sitting there makes way for it (see
+  // unlink_prelocked()).
+  template <class V> base_iterator place_prelocked(base_iterator position, const key_type& k, V&& v)
+  {
+    position = put_prelocked(position, k, std::forward<V>(v));
+    note_insert_prelocked(std::make_pair(position, true));
+    return position;
+  };
+  template <class V> base_iterator put_prelocked(base_iterator position, const key_type& k, V&& v)
   {
-    DEBUG_SIMPLE;
-    GUARD;
-    std::map<key_type, mapped_type> tmp;
-    for (auto iter = m_map->begin(); iter != m_map->end(); )
+    if ((position != m_map->end()) && !m_map->key_comp()(k, position->first))
     {
-      if (!iter->second._erase_when_unused)
+      if (!position->second._reference_count)
       {
-        tmp.emplace(iter->first, iter->second);
-        if (!iter->second._reference_count)
-        {
-          iter = m_map->erase(iter);
-          continue;
-        }
-        else
-          iter->second._erase_when_unused = true;
+        note_erase_prelocked(*position);
+        position = m_map->erase(position);
+      }
+      else
+      {
+#if __cplusplus >= 201703L
+        position = unlink_prelocked(position);
+#else
+        position->second = std::forward<V>(v);	// No way to unlink a node before C++17, so the holders see the new value
+        position->second._erase_when_unused = false;
+        return position;
+#endif
       }
-      ++iter;
     }
-    for (auto& i : x)
-      m_map->emplace(i.first, i.second); 
-    tmp.swap(x);
+    return m_map->emplace_hint(position, k, std::forward<V>(v));
   };
-  iterator upper_bound(const key_type& k)
-    { DEBUG_SIMPLE; GUARD; return iterator(m_map->upper_bound(k), m_map, m_lock); };
-  const_iterator upper_bound(const key_type& k) const
-    { DEBUG_SIMPLE; GUARD; return const_iterator(m_map->upper_bound(k), m_map, m_lock); };
-  value_compare value_comp() const { return m_map->value_comp(); };
 
-  void clear() noexcept
+#if __cplusplus >= 201703L
+  // A flagged element whose key is being inserted again, while iterators
+  // still hold it, is taken out of the tree and parked here: like an unlinked
+  // inode, it stays as it was for those holding it, and the new value gets a
+  // node of its own.  The last iterator to let go frees it.  Stepping from
+  // one carries on from its key's place in the tree.  The parking lot is
+  // shared by all maps of a type, so it has its own lock, always taken after
+  // the map's.
+  struct unlinked_nodes
   {
-    GUARD;
-    clear_prelocked();
+    std::mutex lock;
+    std::map<const void*, node_type> nodes;
   };
-  
-  void clear_fast() noexcept
+  static unlinked_nodes& parked()
   {
-    DEBUG_SIMPLE;
-    GUARD;
-    for (auto iter = m_map->begin(); iter != m_map->end(); ++iter)
-      iter->second._erase_when_unused = true;
+    static unlinked_nodes ret;
+    return ret;
   };
-  
-  size_type erase(const key_type& k)
+
+  base_iterator unlink_prelocked(base_iterator position)
   {
-    DEBUG_SIMPLE;
-    GUARD;
-    auto iter = m_map->find(k);
-    if (iter != m_map->end())
+    auto next = std::next(position);
+    position->second._unlinked = true;
+    auto& o = parked();
+    std::lock_guard<std::mutex> g(o.lock);
+    o.nodes.emplace(&*position, m_map->extract(position));
+    return next;
+  };
+  static void release_unlinked(const void* node)
+  {
+    auto& o = parked();
+    node_type nh;	// Destroyed after the lock's let go
+    std::lock_guard<std::mutex> g(o.lock);
+    auto iter = o.nodes.find(node);
+    ASSERT(iter != o.nodes.end());
+    nh = std::move(iter->second);
+    o.nodes.erase(iter);
+  };
+#endif
+
+  // Where a caller's iterator stands in the tree.  An unlinked element's out
+  // of it, so it stands where its key would go.
+  template <class I, class J> I anchor_prelocked(const J& iter) const
+  {
+    const I& ret = iter;
+    if ((ret != m_map->end()) && ret->second._unlinked)
+      return m_map->lower_bound(ret->first);
+    return ret;
+  };
+
+  // emplace() of a key and a value replaces a flagged element with that key
+  // (erased, but maybe still pinned by some iterator) instead of failing on
+  // it.  Anything else goes straight to std::map.
+  template <class... Args> struct is_key_value : std::false_type {};
+  template <class K, class V> struct is_key_value<K, V> : std::is_convertible<K, const key_type&> {};
+
+  template <class K, class V> std::pair<base_iterator, bool> emplace_prelocked(std::true_type, K&& key, V&& v)
+  {
+    const key_type& k = key;
+    base_iterator iter;
+    if (find_live_prelocked(k, iter))
+      return std::make_pair(iter, false);
+    return std::make_pair(put_prelocked(iter, k, std::forward<V>(v)), true);
+  };
+  template <class... Args> std::pair<base_iterator, bool> emplace_prelocked(std::false_type, Args&&... args)
+    { return m_map->emplace(std::forward<Args>(args)...); };
+
+#if __cplusplus >= 201703L
+  // Puts nh at the position found by find_live_prelocked().  A flagged element
+  // with the same key makes way for it, as in put_prelocked().
+  base_iterator insert_node_prelocked(base_iterator position, node_type&& nh)
+  {
+    if ((position != m_map->end()) && !m_map->key_comp()(nh.key(), position->first))
     {
-      erase_prelocked(iter);
-      return 1;
+      if (position->second._reference_count)
+        position = unlink_prelocked(position);
+      else
+      {
+        note_erase_prelocked(*position);
+        position = m_map->erase(position);
+      }
     }
-    else
-      return 0;
+    position = m_map->insert(position, std::move(nh));
+    note_insert_prelocked(std::make_pair(position, true));
+    return position;
   };
 
-  size_type erase_fast(const key_type& k)
+  // Moves src's element at iter into this map, both maps being locked, and
+  // returns the element after it in src.  hint tracks where the last one went,
+  // so feeding elements in order is cheap.
+  base_iterator take_prelocked(map& src, base_iterator iter, base_iterator& hint)
   {
-    DEBUG_SIMPLE;
-    GUARD;
-    auto iter = m_map->find(k);
-    if (iter != m_map->end())
+    auto next = iter;
+    ++next;
+    if (iter->second._erase_when_unused)
+      return next;
+    hint = lower_bound_near(*m_map, hint, iter->first);
+    if ((hint != m_map->end()) && !m_map->key_comp()(iter->first, hint->first) && !hint->second._erase_when_unused)
+      return next;
+    src.note_erase_prelocked(*iter);
+    if (iter->second._reference_count)
     {
+      hint = place_prelocked(hint, iter->first, static_cast<const mapped_type&>(iter->second));
       iter->second._erase_when_unused = true;
-      return 1;
     }
     else
-      return 0;
+      hint = insert_node_prelocked(hint, src.m_map->extract(iter));
+    return next;
   };
+#endif
 
-  iterator_base<base_iterator, false> erase(iterator_base<base_iterator, false> position) { DEBUG_SIMPLE; GUARD; return erase_prelocked(position); };
-  template <class U, bool V> iterator_base<U, V> erase(iterator_base<U, V>& position) { DEBUG_SIMPLE; GUARD; return erase_prelocked(position); };
+  iterator deconst_iter(const const_iterator& i)
+    { return m_map->erase(i, i); }	// Doesn't actually erase anything
+  
+  safe_value_type safe_value(const value_type& val) const
+    { return safe_value_type(val.first, safe_mapped_type(val.second)); };
+};
+
+// Read-only copy of a safe::map.  The live entries are packed into a sorted
+// array (for iteration) plus an Eytzinger-ordered copy of the keys (for
+// searching), both held behind a shared_ptr.  Since nothing ever changes
+// after construction there's no lock and no per-element reference counting;
+// iterators just hold on to the shared storage, so they stay valid even if
+// the frozen_map itself goes away.
+template <class key_type, class mapped_type, typename Compare = std::less<key_type>>
+class frozen_map
+{
+public:
 
-  void erase_fast(iterator_base<base_iterator, false> position) { DEBUG_SIMPLE; position->_erase_when_unused = true; };
-  template <class U, bool V> void erase_fast(iterator_base<U, V>& position) { DEBUG_SIMPLE; position->_erase_when_unused = true; };
+  typedef std::pair<key_type, mapped_type>		value_type;
+  typedef size_t					size_type;
+  typedef Compare					key_compare;
 
-  template <class U, bool V> const iterator_base<U, V> erase(const iterator_base<U, V>& first, const iterator_base<U, V>& last)
+protected:
+
+  struct storage
+  {
+    storage(const Compare& _comp) : comp(_comp) {};
+
+    std::vector<value_type> values;	// Sorted, as in the source map
+    std::vector<key_type> layout;	// Eytzinger order, 1-based (slot 0 unused)
+    std::vector<size_type> position;	// Index into values for each layout slot
+    Compare comp;
+  };
+
+public:
+
+  class const_iterator
+  {
+  public:
+    typedef std::bidirectional_iterator_tag		iterator_category;
+    typedef typename frozen_map::value_type		value_type;
+    typedef std::ptrdiff_t				difference_type;
+    typedef const value_type*				pointer;
+    typedef const value_type&				reference;
+
+    const_iterator() : m_index(0) {};
+    const_iterator(const std::shared_ptr<const storage>& _storage, const size_type _index) :
+      m_storage(_storage),
+      m_index(_index)
+      {};
+
+    reference operator*() const { return m_storage->values[m_index]; };
+    pointer operator->() const { return &m_storage->values[m_index]; };
+    const_iterator& operator++() { ++m_index; return *this; };
+    const_iterator& operator--() { --m_index; return *this; };
+    const_iterator operator++(int) { auto ret = *this; ++m_index; return ret; };
+    const_iterator operator--(int) { auto ret = *this; --m_index; return ret; };
+    bool operator==(const const_iterator& rhs) const { return (m_index == rhs.m_index) && (m_storage == rhs.m_storage); };
+    bool operator!=(const const_iterator& rhs) const { return !(*this == rhs); };
+
+  protected:
+    std::shared_ptr<const storage> m_storage;
+    size_type m_index;
+  };
+
+  typedef const_iterator				iterator;
+  typedef std::reverse_iterator<const_iterator>		const_reverse_iterator;
+  typedef const_reverse_iterator			reverse_iterator;
+
+  explicit frozen_map(const Compare& comp = Compare()) :
+    m_storage(std::make_shared<storage>(comp))
+    { DEBUG_SIMPLE; };
+
+  // The source map is only locked a block at a time (see map::snapshot()).
+  template <class Map>
+  explicit frozen_map(const Map& other, const Compare& comp = Compare())
   {
     DEBUG_SIMPLE;
-    GUARD;
-    ASSERT(first.m_map == last.m_map);
-    auto iter = (V ? static_cast<base_iterator>(last) : static_cast<base_iterator>(first));
-    auto end = (V ? static_cast<base_iterator>(first) : static_cast<base_iterator>(last));
-    for (; iter != end; )
+    auto s = std::make_shared<storage>(comp);
+    other.copy_cut(s->values);
+    build(*s);
+    m_storage = s;
+  };
+
+  const mapped_type& at(const key_type& k) const
+  {
+    auto iter = find(k);
+    if (iter == end())
+      throw std::out_of_range("frozen_map::at");
+    return iter->second;
+  };
+  const_iterator begin() const noexcept { return const_iterator(m_storage, 0); };
+  const_iterator cbegin() const noexcept { return begin(); };
+  const_iterator end() const noexcept { return const_iterator(m_storage, size()); };
+  const_iterator cend() const noexcept { return end(); };
+  const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator(end()); };
+  const_reverse_iterator crbegin() const noexcept { return rbegin(); };
+  const_reverse_iterator rend() const noexcept { return const_reverse_iterator(begin()); };
+  const_reverse_iterator crend() const noexcept { return rend(); };
+  size_type count(const key_type& k) const { return (find(k) == end() ? 0 : 1); };
+  bool empty() const noexcept { return m_storage->values.empty(); };
+  std::pair<const_iterator, const_iterator> equal_range(const key_type& k) const
+    { return std::make_pair(lower_bound(k), upper_bound(k)); };
+  const_iterator find(const key_type& k) const
+  {
+    const size_type i = lower_bound_index(k);
+    if ((i == size()) || m_storage->comp(k, m_storage->values[i].first))
+      return end();
+    return const_iterator(m_storage, i);
+  };
+  key_compare key_comp() const { return m_storage->comp; };
+  const_iterator lower_bound(const key_type& k) const { return const_iterator(m_storage, lower_bound_index(k)); };
+  size_type size() const noexcept { return m_storage->values.size(); };
+  const_iterator upper_bound(const key_type& k) const { return const_iterator(m_storage, upper_bound_index(k)); };
+
+protected:
+
+  static void build(storage& s)
+  {
+    s.layout.resize(s.values.size() + 1);
+    s.position.resize(s.values.size() + 1);
+    size_type i = 0;
+    build_helper(s, i, 1);
+  };
+
+  static void build_helper(storage& s, size_type& i, const size_type k)
+  {
+    if (k > s.values.size())
+      return;
+    build_helper(s, i, 2 * k);
+    s.layout[k] = s.values[i].first;
+    s.position[k] = i++;
+    build_helper(s, i, 2 * k + 1);
+  };
+
+  // Both searches walk down the implicit tree, then back up past the run of
+  // right turns at the bottom to find the last node where we went left.
+  size_type lower_bound_index(const key_type& key) const
+  {
+    const storage& s = *m_storage;
+    const size_type n = s.values.size();
+    size_type k = 1;
+    while (k <= n)
+      k = 2 * k + (s.comp(s.layout[k], key) ? 1 : 0);
+    return resolve(k);
+  };
+
+  size_type upper_bound_index(const key_type& key) const
+  {
+    const storage& s = *m_storage;
+    const size_type n = s.values.size();
+    size_type k = 1;
+    while (k <= n)
+      k = 2 * k + (s.comp(key, s.layout[k]) ? 0 : 1);
+    return resolve(k);
+  };
+
+  size_type resolve(size_type k) const
+  {
+    while (k & 1)
+      k >>= 1;
+    k >>= 1;
+    return (k ? m_storage->position[k] : size());
+  };
+
+  std::shared_ptr<const storage> m_storage;
+};
+
+// Left-right map: for data that's read constantly and written rarely.  Two
+// copies of the backend are kept; readers never lock, they just announce
+// themselves on a read indicator and use whichever copy is current.  A writer
+// (writers do take a lock amongst themselves) applies its change to the copy
+// nobody is reading, points new readers at it, waits for readers of the old
+// copy to drain away, and then applies the same change to the old copy.
+//
+// Values can only be read through the iterators; changes go through the map
+// (emplace, insert, assign, erase, clear), since each change has to be made
+// twice.  Note that a writer waits for all outstanding iterators on the old
+// copy, so don't keep iterators around for long - and never across a write
+// from the same thread, which would wait on itself forever.
+template <class key_type, class mapped_type,
+          typename Compare = std::less<key_type>,
+          DestructorSafetyType destructor = SharedPointer>
+class left_right_map
+{
+public:
+
+  typedef std::map<key_type, mapped_type, Compare>	basetype;
+  typedef typename basetype::size_type			size_type;
+  typedef std::pair<key_type, mapped_type>		value_type;
+  typedef typename basetype::const_iterator		base_const_iterator;
+  typedef typename basetype::key_compare		key_compare;
+
+protected:
+
+  template <bool B> struct DummyB {};
+
+  static const int reader_slots = 32;
+
+  struct padded_counter	// One per cache line, so readers on different cores don't fight over it
+  {
+    padded_counter() : count(0) {};
+    std::atomic<int> count;
+    char pad[64 - sizeof(std::atomic<int>)];
+  };
+
+  struct state
+  {
+    state(const Compare& comp) :
+      instances{basetype(comp), basetype(comp)},
+      left_right(0),
+      version_index(0)
+      {};
+
+    basetype instances[2];
+    std::atomic<int> left_right;	// Which instance new readers should use
+    std::atomic<int> version_index;	// Which read indicator new readers should announce themselves on
+    padded_counter readers[2][reader_slots];
+    std::mutex writer_lock;
+  };
+
+  typedef typename std::conditional<destructor == SharedPointer, std::shared_ptr<state>, std::unique_ptr<state>>::type state_pointer_type;
+  typedef typename std::conditional<destructor == SharedPointer, std::shared_ptr<state>, state*>::type iter_state_pointer_type;
+
+public:
+
+  class const_iterator
+  {
+  public:
+    typedef std::bidirectional_iterator_tag		iterator_category;
+    typedef typename basetype::value_type		value_type;
+    typedef std::ptrdiff_t				difference_type;
+    typedef const value_type*				pointer;
+    typedef const value_type&				reference;
+
+    // The indicator is the one the iterator was made on, not the current
+    // thread's, so a copy or destruction on another thread balances it.
+    const_iterator(const iter_state_pointer_type& _state, const int _version, const int _slot, const int _instance, const base_const_iterator& _iter) :
+      m_state(_state),
+      m_version(_version),
+      m_slot(_slot),
+      m_instance(_instance),
+      m_iter(_iter)
+      {};
+    const_iterator(const const_iterator& rhs) :
+      m_state(rhs.m_state),
+      m_version(rhs.m_version),
+      m_slot(rhs.m_slot),
+      m_instance(rhs.m_instance),
+      m_iter(rhs.m_iter)
+      { arrive(); };	// rhs is still holding the indicator, so the instance can't have been touched yet
+    ~const_iterator()
+      { depart(); };
+
+    const_iterator& operator=(const const_iterator& rhs)
     {
-      ASSERT(iter != m_map->end());
-      if (!iter->second._erase_when_unused)
+      if (this != &rhs)
       {
-        if (!iter->second._reference_count)
-        {
-          iter = m_map->erase(iter);
-          continue;
-        }
-        else
-          iter->second._erase_when_unused = true;
+        const_iterator tmp(rhs);	// Announce the new position before giving up the old one
+        depart();
+        m_state = tmp.m_state;
+        m_version = tmp.m_version;
+        m_slot = tmp.m_slot;
+        m_instance = tmp.m_instance;
+        m_iter = tmp.m_iter;
+        arrive();
       }
-      ++iter;
-    }
-    return iterator_base<U, V>(iter, m_map, m_lock);
+      return *this;
+    };
+
+    reference operator*() const { return *m_iter; };
+    pointer operator->() const { return &*m_iter; };
+    const_iterator& operator++() { if (!at_end()) ++m_iter; return *this; };
+    const_iterator& operator--() { if (m_iter != instance().begin()) --m_iter; return *this; };
+    const_iterator operator++(int) { auto ret = *this; ++(*this); return ret; };
+    const_iterator operator--(int) { auto ret = *this; --(*this); return ret; };
+
+    // Iterators fetched before and after a write can point into different
+    // instances, so positions are compared by key rather than by node.
+    bool operator==(const const_iterator& rhs) const
+    {
+      const bool end1 = at_end(), end2 = rhs.at_end();
+      if (end1 || end2)
+        return end1 == end2;
+      if (m_instance == rhs.m_instance)
+        return m_iter == rhs.m_iter;
+      const key_compare comp = instance().key_comp();
+      return !comp(m_iter->first, rhs.m_iter->first) && !comp(rhs.m_iter->first, m_iter->first);
+    };
+    bool operator!=(const const_iterator& rhs) const { return !(*this == rhs); };
+
+  protected:
+
+    const basetype& instance() const { return m_state->instances[m_instance]; };
+    bool at_end() const { return m_iter == instance().end(); };
+    void arrive() { m_state->readers[m_version][m_slot].count.fetch_add(1); };
+    void depart() { m_state->readers[m_version][m_slot].count.fetch_sub(1, std::memory_order_release); };
+
+    iter_state_pointer_type m_state;
+    int m_version;
+    int m_slot;
+    int m_instance;
+    base_const_iterator m_iter;
   };
 
-  template <class T> T erase_fast(const T& first, const T& last)
+  typedef const_iterator				iterator;
+
+  explicit left_right_map(const Compare& comp = Compare()) :
+    m_state(new state(comp))
+    { DEBUG_SIMPLE; };
+
+  template<class InputIterator>
+  left_right_map(InputIterator first, InputIterator last, const Compare& comp = Compare()) :
+    m_state(new state(comp))
   {
     DEBUG_SIMPLE;
-    GUARD;
-    ASSERT(first.m_map == last.m_map);
-    auto iter = first;
-    for (; iter != last; ++iter)
-      iter->second._erase_when_unused = true;
-    return iter;
+    m_state->instances[0].insert(first, last);	// The range may only be good for one pass
+    m_state->instances[1] = m_state->instances[0];
   };
 
-  void cleanup() noexcept
+  left_right_map(std::initializer_list<value_type> init, const Compare& comp = Compare()) :
+    m_state(new state(comp))
   {
     DEBUG_SIMPLE;
-    GUARD;
-    for (auto iter = m_map->begin(); iter != m_map->end(); )
-    {
-      if ((iter->second._erase_when_unused) && (!iter->second._reference_count))
-        iter = m_map->erase(iter);
-      else
-        ++iter;
-    }
+    for (auto& instance : m_state->instances)
+      instance.insert(init.begin(), init.end());
   };
-  
-  map_pointer_type m_map;
-  lock_pointer_type m_lock;
-  
+
+  // Readers.  None of these lock.
+  mapped_type at(const key_type& k) const
+    { DEBUG_SIMPLE; return read([&](const basetype& m) -> mapped_type { return m.at(k); }); };
+  const_iterator begin() const noexcept { return cbegin(); };
+  const_iterator cbegin() const noexcept
+    { DEBUG_SIMPLE; return make_iterator([](const basetype& m) { return m.cbegin(); }); };
+  const_iterator cend() const noexcept
+    { DEBUG_SIMPLE; return make_iterator([](const basetype& m) { return m.cend(); }); };
+  size_type count(const key_type& k) const
+    { DEBUG_SIMPLE; return read([&](const basetype& m) { return m.count(k); }); };
+  bool empty() const noexcept
+    { return read([](const basetype& m) { return m.empty(); }); };
+  const_iterator end() const noexcept { return cend(); };
+  std::pair<const_iterator, const_iterator> equal_range(const key_type& k) const
+    { DEBUG_SIMPLE; return std::make_pair(lower_bound(k), upper_bound(k)); };
+  const_iterator find(const key_type& k) const
+    { DEBUG_SIMPLE; return make_iterator([&](const basetype& m) { return m.find(k); }); };
+  key_compare key_comp() const { return m_state->instances[0].key_comp(); };
+  const_iterator lower_bound(const key_type& k) const
+    { DEBUG_SIMPLE; return make_iterator([&](const basetype& m) { return m.lower_bound(k); }); };
+  size_type size() const noexcept
+    { return read([](const basetype& m) { return m.size(); }); };
+  const_iterator upper_bound(const key_type& k) const
+    { DEBUG_SIMPLE; return make_iterator([&](const basetype& m) { return m.upper_bound(k); }); };
+
+  // Writers.  These serialize amongst themselves, and apply each change twice.
+  bool assign(const key_type& k, const mapped_type& v)
+    { DEBUG_SIMPLE; return write([&](basetype& m) { auto ret = m.insert(std::make_pair(k, v)); if (!ret.second) ret.first->second = v; return ret.second; }); };
+  void clear()
+    { DEBUG_SIMPLE; write([](basetype& m) { m.clear(); return true; }); };
+  bool emplace(const key_type& k, const mapped_type& v)
+    { DEBUG_SIMPLE; return write([&](basetype& m) { return m.emplace(k, v).second; }); };
+  size_type erase(const key_type& k)
+    { DEBUG_SIMPLE; return write([&](basetype& m) { return m.erase(k); }); };
+  bool insert(const value_type& val)
+    { DEBUG_SIMPLE; return write([&](basetype& m) { return m.insert(val).second; }); };
+  template <class InputIterator> void insert(InputIterator first, InputIterator last)	// Reads the range once, then applies it twice
+    { DEBUG_SIMPLE; const basetype items(first, last, key_comp()); write([&](basetype& m) { m.insert(items.begin(), items.end()); return true; }); };
+
 protected:
 
-  void clear_prelocked() noexcept
+  static int reader_slot()
   {
-    DEBUG_SIMPLE;
-    for (auto iter = m_map->begin(); iter != m_map->end(); )
-    {
-      if (!iter->second._reference_count)
-        iter = m_map->erase(iter);
-      else
-      {
-        iter->second._erase_when_unused = true;
-        ++iter;
-      }
-    }
+    static std::atomic<unsigned int> next_slot(0);
+    static thread_local int slot = next_slot++ % reader_slots;
+    return slot;
   };
-  
-  template <class U, bool V> iterator_base<U, V>& erase_prelocked(iterator_base<U, V>& iter)
+
+  iter_state_pointer_type state_pointer() const
+    { return fetch_pointer(DummyB<destructor == SharedPointer>()); };
+  iter_state_pointer_type fetch_pointer(const DummyB<true>) const { return m_state; };
+  iter_state_pointer_type fetch_pointer(const DummyB<false>) const { return m_state.get(); };
+
+  template <class F> const_iterator make_iterator(F f) const
   {
-    if (!iter->second._reference_count)
-      iter = m_map->erase(iter);
-    else
-      iter->second._erase_when_unused = true;
-    return iter;
+    const int version = m_state->version_index.load(), slot = reader_slot();
+    m_state->readers[version][slot].count.fetch_add(1);
+    const int instance = m_state->left_right.load();
+    const_iterator ret(state_pointer(), version, slot, instance, f(m_state->instances[instance]));
+    return ret;	// The indicator taken above now belongs to ret
   };
 
-  template <class U> U& erase_prelocked(U& iter)
+  template <class F> auto read(F f) const -> decltype(f(std::declval<const basetype&>()))
   {
-    if (!iter->second._reference_count)
-      iter = m_map->erase(iter);
-    else
-      iter->second._erase_when_unused = true;
-    return iter;
+    const int version = m_state->version_index.load();
+    auto& indicator = m_state->readers[version][reader_slot()].count;
+    indicator.fetch_add(1);
+    struct departure { std::atomic<int>& i; ~departure() { i.fetch_sub(1, std::memory_order_release); } } d{indicator};
+    return f(m_state->instances[m_state->left_right.load()]);
   };
 
-  iterator deconst_iter(const const_iterator& i)
-    { return m_map->erase(i, i); }	// Doesn't actually erase anything
-  
-  safe_value_type safe_value(const value_type& val) const
-    { return safe_value_type(val.first, safe_mapped_type(val.second)); };
+  template <class F> auto write(F f) -> decltype(f(std::declval<basetype&>()))
+  {
+    std::lock_guard<std::mutex> g(m_state->writer_lock);
+    const int current = m_state->left_right.load();
+    auto ret = f(m_state->instances[!current]);
+    m_state->left_right.store(!current);
+    toggle_version_and_wait();
+    f(m_state->instances[current]);
+    return ret;
+  };
+
+  void toggle_version_and_wait()
+  {
+    const int previous = m_state->version_index.load();
+    const int next = !previous;
+    wait_for_readers(next);	// Stragglers from the last toggle
+    m_state->version_index.store(next);
+    wait_for_readers(previous);
+  };
+
+  void wait_for_readers(const int version)
+  {
+    for (auto& reader : m_state->readers[version])
+      while (reader.count.load(std::memory_order_acquire))
+        std::this_thread::yield();
+  };
+
+  state_pointer_type m_state;
 };
 
 